@@ -0,0 +1,268 @@
+#include "CodeWriter.h"
+#include <fstream>
+#include <stdexcept>
+
+using namespace std;
+
+static const char* segBase[] = {	// pointer register of each indirect SEGMENT
+	"", "ARG", "LCL", "", "THIS", "THAT", "", "", ""
+};
+
+/* CODEWRITER FUNCTIONS */
+CodeWriter::CodeWriter(bool trampolines) {
+	this->trampolines = trampolines;
+	labelCount = 0;
+}
+
+void CodeWriter::setFileName(string_view name) {
+	fileName = string(name);
+}
+
+string& CodeWriter::text() {
+	return out;
+}
+
+void CodeWriter::close(string path) {
+	// one open, one write, one close for the whole program
+	ofstream outFile(path, ios::binary);
+	if (!outFile.write(out.data(), out.size()))
+		throw runtime_error("cannot write " + path);
+}
+
+string CodeWriter::newLabel(const char* kind) {
+	return function + '$' + kind + '.' + to_string(labelCount++);
+}
+
+void CodeWriter::pushD() {
+	out += "@SP\nAM=M+1\nA=A-1\nM=D\n";
+}
+
+void CodeWriter::popD() {
+	out += "@SP\nAM=M-1\nD=M\n";
+}
+
+void CodeWriter::writeInit() {
+	function = "$$init";
+	labelCount = 0;
+	out += "@256\nD=A\n@SP\nM=D\n";
+	writeCall("Sys.init", 0);	// never returns
+}
+
+void CodeWriter::write(const VMCode& code) {
+	for (const VMInstr& in : code.code) {
+		switch (in.op) {
+		case OP_PUSH: writePush((SEGMENT)in.seg, in.arg); break;
+		case OP_POP: writePop((SEGMENT)in.seg, in.arg); break;
+		case OP_LABEL:
+			out += '(';
+			out += function;
+			out += '$';
+			out += code.nameOf(in.name);
+			out += ")\n";
+			break;
+		case OP_GOTO:
+			out += '@';
+			out += function;
+			out += '$';
+			out += code.nameOf(in.name);
+			out += "\n0;JMP\n";
+			break;
+		case OP_IF:
+		case OP_IFNOT:	// "not; if-goto": !D is nonzero exactly when D + 1 is
+			popD();
+			if (in.op == OP_IFNOT)
+				out += "D=D+1\n";
+			out += '@';
+			out += function;
+			out += '$';
+			out += code.nameOf(in.name);
+			out += "\nD;JNE\n";
+			break;
+		case OP_CALL: writeCall(code.nameOf(in.name), in.arg); break;
+		case OP_FUNCTION: writeFunction(code.nameOf(in.name), in.arg); break;
+		case OP_RETURN: writeReturn(); break;
+		default: writeArithmetic((VMOP)in.op); break;
+		}
+	}
+}
+
+void CodeWriter::writePush(SEGMENT seg, int index) {
+	switch (seg) {
+	case SEG_CONST:
+		if (index == 0 || index == 1) {	// M can be set to 0 or 1 without going through D
+			out += "@SP\nAM=M+1\nA=A-1\nM=";
+			out += index ? "1\n" : "0\n";
+			return;
+		}
+		out += '@' + to_string(index) + "\nD=A\n";
+		break;
+	case SEG_STATIC:
+		out += '@' + fileName + '.' + to_string(index) + "\nD=M\n";
+		break;
+	case SEG_POINTER:
+		out += "@R" + to_string(3 + index) + "\nD=M\n";
+		break;
+	case SEG_TEMP:
+		out += "@R" + to_string(5 + index) + "\nD=M\n";
+		break;
+	default:	// argument, local, this, that
+		out += '@';
+		out += segBase[seg];
+		if (index == 0)
+			out += "\nA=M\nD=M\n";
+		else if (index == 1)
+			out += "\nA=M+1\nD=M\n";
+		else
+			out += "\nD=M\n@" + to_string(index) + "\nA=D+A\nD=M\n";
+		break;
+	}
+	pushD();
+}
+
+void CodeWriter::writePop(SEGMENT seg, int index) {
+	switch (seg) {
+	case SEG_STATIC:
+		popD();
+		out += '@' + fileName + '.' + to_string(index) + "\nM=D\n";
+		break;
+	case SEG_POINTER:
+		popD();
+		out += "@R" + to_string(3 + index) + "\nM=D\n";
+		break;
+	case SEG_TEMP:
+		popD();
+		out += "@R" + to_string(5 + index) + "\nM=D\n";
+		break;
+	default:	// argument, local, this, that
+		if (index <= 6) {	// step A up to the slot: cheaper than parking the address in R13
+			popD();
+			out += '@';
+			out += segBase[seg];
+			out += index == 0 ? "\nA=M\n" : "\nA=M+1\n";
+			for (int i = 1; i < index; i++)
+				out += "A=A+1\n";
+			out += "M=D\n";
+		}
+		else {
+			out += '@';
+			out += segBase[seg];
+			out += "\nD=M\n@" + to_string(index) + "\nD=D+A\n@R13\nM=D\n";
+			popD();
+			out += "@R13\nA=M\nM=D\n";
+		}
+		break;
+	}
+}
+
+void CodeWriter::writeArithmetic(VMOP op) {
+	string label;
+	switch (op) {
+	case OP_ADD: out += "@SP\nAM=M-1\nD=M\nA=A-1\nM=D+M\n"; break;
+	case OP_SUB: out += "@SP\nAM=M-1\nD=M\nA=A-1\nM=M-D\n"; break;
+	case OP_AND: out += "@SP\nAM=M-1\nD=M\nA=A-1\nM=D&M\n"; break;
+	case OP_OR: out += "@SP\nAM=M-1\nD=M\nA=A-1\nM=D|M\n"; break;
+	case OP_NEG: out += "@SP\nA=M-1\nM=-M\n"; break;
+	case OP_NOT: out += "@SP\nA=M-1\nM=!M\n"; break;
+	case OP_EQ:
+	case OP_GT:
+	case OP_LT:
+		label = newLabel("cmp");
+		if (trampolines) {	// D = where the routine comes back to
+			out += '@' + label + "\nD=A\n@";
+			out += op == OP_EQ ? "$$EQ" : op == OP_GT ? "$$GT" : "$$LT";
+			out += "\n0;JMP\n(" + label + ")\n";
+		}
+		else
+			writeCompare(label, op == OP_EQ ? "JEQ" : op == OP_GT ? "JGT" : "JLT");
+		break;
+	default: break;
+	}
+}
+
+void CodeWriter::writeCompare(const string& label, const char* jump) {
+	// x - y sets the flags; the result slot is true until the jump is not taken
+	out += "@SP\nAM=M-1\nD=M\nA=A-1\nD=M-D\nM=-1\n@" + label + "\nD;";
+	out += jump;
+	out += "\n@SP\nA=M-1\nM=0\n(" + label + ")\n";
+}
+
+void CodeWriter::writeFunction(string_view name, int nLocals) {
+	function = string(name);
+	labelCount = 0;
+	out += '(' + function + ")\n";
+	if (nLocals > 0) {	// zero the locals in one sweep, then move SP past them
+		out += "@SP\nA=M\n";
+		for (int i = 0; i < nLocals; i++)
+			out += "M=0\nA=A+1\n";
+		out += "D=A\n@SP\nM=D\n";
+	}
+}
+
+void CodeWriter::writeCall(string_view name, int nArgs) {
+	string ret = newLabel("ret");
+	if (trampolines) {	// R13 = callee, R14 = nArgs + 5, D = return address
+		out += '@';
+		out += name;
+		out += "\nD=A\n@R13\nM=D\n@" + to_string(nArgs + 5) + "\nD=A\n@R14\nM=D\n@" + ret + "\nD=A\n@$$CALL\n0;JMP\n";
+	}
+	else {
+		out += '@' + ret + "\nD=A\n";
+		pushD();
+		writeFrame();
+		out += "@SP\nD=M\n@" + to_string(nArgs + 5) + "\nD=D-A\n@ARG\nM=D\n@SP\nD=M\n@LCL\nM=D\n@";
+		out += name;
+		out += "\n0;JMP\n";
+	}
+	out += '(' + ret + ")\n";
+}
+
+void CodeWriter::writeFrame() {
+	for (const char* reg : { "LCL", "ARG", "THIS", "THAT" }) {
+		out += '@';
+		out += reg;
+		out += "\nD=M\n";
+		pushD();
+	}
+}
+
+void CodeWriter::writeReturn() {
+	if (trampolines)
+		out += "@$$RETURN\n0;JMP\n";
+	else
+		writeUnwind();
+}
+
+void CodeWriter::writeUnwind() {
+	// R13 = frame, R14 = return address; it must be read before the return value can overwrite it
+	out += "@LCL\nD=M\n@R13\nM=D\n@5\nA=D-A\nD=M\n@R14\nM=D\n";
+	popD();
+	out += "@ARG\nA=M\nM=D\n@ARG\nD=M+1\n@SP\nM=D\n";
+	for (const char* reg : { "THAT", "THIS", "ARG", "LCL" }) {
+		out += "@R13\nAM=M-1\nD=M\n@";
+		out += reg;
+		out += "\nM=D\n";
+	}
+	out += "@R14\nA=M\n0;JMP\n";
+}
+
+void CodeWriter::writeRoutines() {
+	if (!trampolines)
+		return;
+	// call: push the return address in D, save the frame, ARG = SP - R14, LCL = SP, go to R13
+	out += "($$CALL)\n";
+	pushD();
+	writeFrame();
+	out += "@SP\nD=M\n@R14\nD=D-M\n@ARG\nM=D\n@SP\nD=M\n@LCL\nM=D\n@R13\nA=M\n0;JMP\n";
+	out += "($$RETURN)\n";
+	writeUnwind();
+	// compares: D = return address, kept in R15 while the flags are worked out
+	out += "($$EQ)\n@R15\nM=D\n";
+	writeCompare("$$EQ.end", "JEQ");
+	out += "@R15\nA=M\n0;JMP\n";
+	out += "($$GT)\n@R15\nM=D\n";
+	writeCompare("$$GT.end", "JGT");
+	out += "@R15\nA=M\n0;JMP\n";
+	out += "($$LT)\n@R15\nM=D\n";
+	writeCompare("$$LT.end", "JLT");
+	out += "@R15\nA=M\n0;JMP\n";
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include "VMCode.h"
+
+class CodeWriter {
+	/* Hack assembly straight from VMCode: the nand2tetris VM translator without the
+	.vm text in between. Labels are scoped to their function (Main.main$WHILE_EXP0),
+	statics to their file (Main.3). With trampolines, call, return and the compares
+	become a few instructions that jump into one shared copy of the sequence, which
+	writeRoutines() appends once; that trades a few cycles per call for ROM.
+	*/
+	std::string out;
+	std::string fileName;	// Xxx of Xxx.vm
+	std::string function;	// function being written
+	int labelCount;	// return and compare labels of the current function
+	bool trampolines;
+	void pushD();
+	void popD();
+	void writePush(SEGMENT seg, int index);
+	void writePop(SEGMENT seg, int index);
+	void writeArithmetic(VMOP op);
+	void writeCall(std::string_view name, int nArgs);
+	void writeFunction(std::string_view name, int nLocals);
+	void writeReturn();
+	void writeFrame();	// call sequence after the return address: saves LCL, ARG, THIS, THAT
+	void writeUnwind();	// return sequence: restores the caller and jumps back
+	void writeCompare(const std::string& label, const char* jump);	// eq, gt, lt: true if x - y jumps; label ends it
+	std::string newLabel(const char* kind);	// function$kind.n
+public:
+	CodeWriter(bool trampolines = false);
+	void setFileName(std::string_view name);	// statics of the code written next are name.i
+	void writeInit();	// bootstrap: SP = 256, call Sys.init
+	void write(const VMCode& code);	// translates one class
+	void writeRoutines();	// the shared sequences trampolines jump to; nothing without trampolines
+	std::string& text();	// assembly written so far
+	void close(std::string path);	// writes text() to path; throws if it cannot
+};
@@ -0,0 +1,43 @@
+#include "JackAST.h"
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+
+/* ARENA FUNCTIONS */
+Arena::Arena() {
+	current = 0;
+	used = BLOCK;	// no block yet: the first grab() adds one
+}
+
+Arena::~Arena() {
+	for (char* b : blocks)
+		free(b);
+}
+
+void* Arena::grab(size_t n) {
+	n = (n + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+	if (used + n > BLOCK) {	// move on to the next block; nodes are small, so it always has room
+		size_t next = blocks.empty() ? 0 : current + 1;
+		if (next == blocks.size()) {
+			char* b = static_cast<char*>(malloc(BLOCK));
+			if (!b)
+				throw bad_alloc();
+			blocks.push_back(b);
+		}
+		current = next;
+		used = 0;
+	}
+	void* p = blocks[current] + used;
+	used += n;
+	return p;
+}
+
+void Arena::reset() {
+	current = 0;
+	used = blocks.empty() ? BLOCK : 0;
+}
+
+size_t Arena::capacity() {
+	return blocks.size() * BLOCK;
+}
@@ -0,0 +1,101 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+
+/*
+*	Syntax tree for one Jack class. Nodes are plain structs carved out of an Arena:
+*	no constructors, destructors or owned memory, so the whole tree goes away with
+*	one Arena::reset(). Names and types are the tokenizer's interned ids; string literals
+*	are token positions, since interning may still move the tokenizer's text.
+*/
+
+class Arena {
+	/* Bump allocator. reset() rewinds to the first block in O(1) and keeps the blocks,
+	so after the largest class has been seen, building a tree allocates nothing.
+	*/
+	std::vector<char*> blocks;
+	size_t current;	// block being filled
+	size_t used;	// bytes taken from it
+	void* grab(size_t n);
+public:
+	static const size_t BLOCK = 64 * 1024;
+	Arena();
+	~Arena();
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+	template <class T>
+	T* make() {	// value-initialized node
+		T* p = static_cast<T*>(grab(sizeof(T)));
+		*p = T();
+		return p;
+	}
+	void reset();	// frees every node at once
+	size_t capacity();	// bytes held, used or not
+};
+
+enum ASTEXPR {
+	AE_INT,
+	AE_STRING,
+	AE_TRUE,
+	AE_FALSE,
+	AE_NULL,
+	AE_THIS,
+	AE_VAR,
+	AE_INDEX,	// var[left]
+	AE_CALL,
+	AE_UNARY,
+	AE_BINARY
+};
+
+enum ASTSTMT {
+	AS_LET,
+	AS_IF,
+	AS_WHILE,
+	AS_DO,
+	AS_RETURN
+};
+
+struct AstExpr {
+	unsigned char kind;	// ASTEXPR
+	char op;	// AE_UNARY, AE_BINARY: operator symbol
+	int value;	// AE_INT: the constant; AE_VAR, AE_INDEX, AE_CALL: name id; AE_STRING: token position
+	int recv;	// AE_CALL: class or variable name before the dot, -1 if none
+	AstExpr* left;	// AE_UNARY operand, AE_BINARY left side, AE_INDEX subscript, AE_CALL first argument
+	AstExpr* right;	// AE_BINARY right side
+	AstExpr* next;	// next argument of a call
+};
+
+struct AstStmt {
+	unsigned char kind;	// ASTSTMT
+	bool hasElse;	// AS_IF: an else branch was written, even if it is empty
+	int var;	// AS_LET: target name id
+	AstExpr* index;	// AS_LET: subscript when the target is var[index], else null
+	AstExpr* expr;	// AS_LET value, AS_IF/AS_WHILE condition, AS_DO call, AS_RETURN value (null = none)
+	AstStmt* body;	// AS_IF then branch, AS_WHILE body
+	AstStmt* orelse;	// AS_IF else branch
+	AstStmt* next;
+};
+
+struct AstVar {
+	unsigned char kind;	// JackAnalyzer KIND: STATIC, FIELD, ARG or VAR
+	int name;
+	int type;
+	AstVar* next;
+};
+
+struct AstSub {
+	unsigned char kind;	// JackAnalyzer KEYWORDTYPE: K_CONSTRUCTOR, K_FUNCTION or K_METHOD
+	int type;	// return type
+	int name;
+	AstVar* params;
+	AstVar* locals;
+	AstStmt* body;
+	AstSub* next;
+};
+
+struct AstClass {
+	int name;
+	int thisName;	// interned "this", argument 0 of every method
+	AstVar* vars;	// statics and fields in declaration order
+	AstSub* subs;
+};
@@ -4,130 +4,1011 @@
 #include <filesystem>
 #include <algorithm>
 #include <iostream>
+#include <deque>
+#include <stdexcept>
+#include <thread>
+#ifdef JACK_STATS
+#include <chrono>
+#endif
 
 using namespace std;
 
 /*JACK ANALYZER FUNCTIONS*/
-JackAnalyzer::JackAnalyzer(string input, string output) {
-	T = new JackTokenizer(input);
+static const char* compilerVersion = "JackCompiler 2";	// bump whenever the generated code changes
+
+JackAnalyzer::JackAnalyzer(string input, string output) : JackAnalyzer(input, output, Options()) {
+}
+
+JackAnalyzer::JackAnalyzer(string input, string output, Options opt) {
+	vector<string> files;
+	vector<int> order;
+	vector<string> failed;
+	filesystem::path dir;
+
+	if (opt.output == OUT_XML || !filesystem::is_directory(input)) {
+		opt.prune = false;	// these need the VM code of a whole program
+		opt.inlineSize = 0;
+	}
+	bool hold = opt.prune || opt.inlineSize > 0;	// classes are written after a whole-program pass
+	if (opt.output != OUT_VM || opt.hack || hold)
+		opt.cache = false;	// the manifest only vouches for .vm files, and Hack output and whole-program passes need every class in memory
+	this->opt = opt;
+	skipped = 0;
+	inlined = 0;
+#ifdef JACK_STATS
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+#endif
+	if (!filesystem::is_directory(input)) {
+		files.push_back(input);
+		dir = filesystem::path(input).parent_path();
+	}
+	else {
+		// directory mode: every .jack file is compiled on its own, in parallel
+		for (const filesystem::directory_entry& e : filesystem::directory_iterator(input)) {
+			if (e.is_regular_file() && e.path().extension() == ".jack")
+				files.push_back(e.path().string());
+		}
+		sort(files.begin(), files.end());
+		dir = input;
+	}
+	BuildCache cache(dir.string(), stamp(), opt.binary ? ".vmb" : ".vm");
+
+	// hand out the biggest files first so the last job to finish is a short one
+	for (int i = 0; i < (int)files.size(); i++)
+		order.push_back(i);
+	stable_sort(order.begin(), order.end(), [&](int a, int b) {
+		error_code ec;
+		return filesystem::file_size(files[a], ec) > filesystem::file_size(files[b], ec);
+	});
+	failed.resize(files.size());
+	vector<char> reuse(files.size(), 0);
+	vector<string> hack(files.size());	// assembly of each class, joined once all are done
+	vector<VMCode> codes(hold ? files.size() : 0);	// held back until the whole program is known
+#ifdef JACK_STATS
+	stats.assign(files.size(), JackStats::File());
+#endif
+	ThreadPool(opt.jobs).run((int)files.size(), [&](int i) {
+		int f = order[i];
+		uint64_t hash;
+#ifdef JACK_STATS
+		stats[f].name = files[f];
+		JackStats::current = &stats[f];
+#endif
+		try {
+			if (opt.cache && cache.upToDate(files[f], hash))
+				reuse[f] = 1;
+			else {
+				compileFile(files[f], hack[f], hold ? &codes[f] : nullptr);
+				if (opt.cache)
+					cache.record(files[f], hash);
+			}
+		}
+		catch (const exception& e) {
+			failed[f] = e.what();
+		}
+#ifdef JACK_STATS
+		stats[f].cached = reuse[f] != 0;
+		JackStats::current = nullptr;
+#endif
+	});
+	// report in file name order regardless of which thread finished first
+	for (int f = 0; f < (int)files.size(); f++) {
+		if (!failed[f].empty())
+			errors.push_back(files[f] + ": " + failed[f]);
+		skipped += reuse[f];
+	}
+	if (hold && errors.empty()) {
+		try {
+			if (opt.inlineSize > 0)
+				inlineCalls(codes);
+			if (opt.prune)	// after inlining, which can leave callees with no callers
+				prune(input, codes);
+		}
+		catch (const exception& e) {
+			errors.push_back(e.what());
+		}
+	}
+	if (hold && errors.empty()) {
+		// what the workers held back: write each class and lower it, now in its whole-program form
+		ThreadPool(opt.jobs).run((int)files.size(), [&](int i) {
+			int f = order[i];	// biggest first again
+			string name = files[f].substr(0, files[f].length() - 5);
+#ifdef JACK_STATS
+			JackStats::current = &stats[f];
+#endif
+			try {
+				if (!opt.hack || opt.keepVM)
+					VMWriter::write(codes[f], name + (opt.binary ? ".vmb" : ".vm"), opt.binary);
+				if (opt.hack)
+					lower(codes[f], files[f], hack[f]);
+			}
+			catch (const exception& e) {
+				failed[f] = e.what();
+			}
+#ifdef JACK_STATS
+			JackStats::current = nullptr;
+#endif
+		});
+		for (int f = 0; f < (int)files.size(); f++) {
+			if (!failed[f].empty())
+				errors.push_back(files[f] + ": " + failed[f]);
+		}
+	}
+	if (opt.hack && errors.empty()) {
+		try {
+			link(input, hack);
+		}
+		catch (const exception& e) {
+			errors.push_back(e.what());
+		}
+	}
+	for (const string& e : errors)
+		cerr << e << '\n';
+	if (inlined > 0)
+		cerr << "inlined " << inlined << " call" << (inlined == 1 ? "" : "s") << '\n';
+	if (!removed.empty()) {
+		cerr << "pruned " << removed.size() << " unreachable subroutine" << (removed.size() == 1 ? "" : "s") << ":\n";
+		for (const string& r : removed)
+			cerr << "  " << r << '\n';
+	}
+	if (opt.cache) {
+		if (filesystem::is_directory(input))
+			cache.keepOnly(files);
+		cache.save();
+	}
+#ifdef JACK_STATS
+	wallMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+#endif
+}
+
+static vector<string> extraFiles(string dir) {
+	// .vm/.vmb files in dir with no .jack next to them, one per class (the .vmb where both are there)
+	vector<string> files;
+	for (const filesystem::directory_entry& e : filesystem::directory_iterator(dir)) {
+		filesystem::path p = e.path();
+		if (!e.is_regular_file() || filesystem::exists(filesystem::path(p).replace_extension(".jack")))
+			continue;
+		if (p.extension() == ".vmb" || (p.extension() == ".vm" && !filesystem::exists(filesystem::path(p).replace_extension(".vmb"))))
+			files.push_back(p.string());
+	}
+	sort(files.begin(), files.end());
+	return files;
+}
+
+static void readVM(string file, VMCode& code) {
+	ifstream in(file, ios::binary);
+	string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+	try {
+		if (VMCode::isBinary(data))
+			code.readBinary(data);
+		else
+			code.parse(data);
+	}
+	catch (const exception& e) {
+		throw runtime_error(file + ": " + e.what());
+	}
+}
+
+void JackAnalyzer::compileFile(string input, string& hack, VMCode* keep) {
+	switch (opt.output) {
+	case OUT_XML: compileFileWith<XMLOnly>(input, hack, keep); break;
+	case OUT_BOTH: compileFileWith<VMAndXML>(input, hack, keep); break;
+	default: compileFileWith<VMOnly>(input, hack, keep); break;
+	}
+}
+
+template <class Output>
+void JackAnalyzer::compileFileWith(string input, string& hack, VMCode* keep) {
+	JackTokenizer T(input, opt.buffered);
 	string name = input.substr(0, input.length() - 5);
-	C = new CompilationEngine(T, name);
+	CompilationEngine<Output> C(&T, name, opt);
+	C.compile();
+	if constexpr (Output::vm) {
+		if (keep)	// the engine's code dies with it; keep a copy with its own names
+			keep->append(C.finish());
+		else if (opt.hack)	// lowered from the instructions in memory, never from .vm text
+			lower(C.finish(), input, hack);
+	}
+	C.close();
 }
 
-JackAnalyzer::~JackAnalyzer() {
-	delete T;
-	delete C;
+void JackAnalyzer::lower(const VMCode& code, string input, string& hack) {
+	STAT_TIMER(emitNs);
+	CodeWriter W(opt.trampolines);
+	W.setFileName(filesystem::path(input).stem().string());
+	W.write(code);
+	hack.swap(W.text());
+}
+
+void JackAnalyzer::inlineCalls(vector<VMCode>& codes) {
+	/*
+	*	Every class's subroutines go into one index first, so a call is inlined whichever
+	*	class the callee lives in. A copy's arguments and locals move to local slots past
+	*	the caller's own; all copies in a caller share those slots, since one always
+	*	finishes before the next begins. Its labels get a per-copy prefix and a return
+	*	becomes a jump past the copy. Nothing is inlined into a copy, and the program may
+	*	grow by at most 1/inlineGrowth of its size (inlineFloor for small ones).
+	*/
+	unordered_map<string, Signature> index;
+	vector<vector<VMInstr>> result(codes.size());
+	long long budget = 0;
+	int site = 0;
+
+	for (int f = 0; f < (int)codes.size(); f++) {
+		const vector<VMInstr>& code = codes[f].code;
+		budget += code.size();
+		for (int i = 0; i < (int)code.size(); i++) {
+			if (code[i].op != OP_FUNCTION)
+				continue;
+			string_view name = codes[f].nameOf(code[i].name);
+			Signature s = { f, i, i + 1, code[i].arg, 0, true, false, false, false };
+			for (; s.end < (int)code.size() && code[s.end].op != OP_FUNCTION; s.end++) {
+				const VMInstr& in = code[s.end];
+				if (in.op == OP_PUSH || in.op == OP_POP) {
+					if (in.seg == SEG_ARG)
+						s.args = max(s.args, in.arg + 1);
+					s.statics |= in.seg == SEG_STATIC;
+					s.setsThis |= in.op == OP_POP && in.seg == SEG_POINTER && in.arg == 0;
+					s.usesThis |= in.seg == SEG_THIS || (in.op == OP_PUSH && in.seg == SEG_POINTER && in.arg == 0);
+				}
+				else if (in.op == OP_CALL && codes[f].nameOf(in.name) == name)
+					s.inlinable = false;	// recursive
+			}
+			s.inlinable = s.inlinable && s.end - s.entry - 1 <= opt.inlineSize && code[s.end - 1].op == OP_RETURN;
+			index[string(name)] = s;
+		}
+	}
+	budget = max(budget / inlineGrowth, (long long)inlineFloor);
+
+	for (int f = 0; f < (int)codes.size(); f++) {
+		VMCode& caller = codes[f];
+		vector<VMInstr>& out = result[f];
+		const Signature* me = nullptr;	// subroutine being copied into
+		size_t head = 0;	// its function command in out
+		int extra = 0;	// local slots its copies need
+		out.reserve(caller.code.size());
+		for (const VMInstr& in : caller.code) {
+			if (in.op == OP_FUNCTION) {
+				if (me)
+					out[head].arg += extra;
+				head = out.size();
+				me = &index[string(caller.nameOf(in.name))];
+				extra = 0;
+			}
+			unordered_map<string, Signature>::const_iterator it;
+			if (in.op != OP_CALL || !me || (it = index.find(string(caller.nameOf(in.name)))) == index.end()) {
+				out.push_back(in);
+				continue;
+			}
+			const Signature& s = it->second;
+			int size = s.end - s.entry - 1;
+			if (!s.inlinable || s.args > in.arg || (s.statics && s.file != f) || size > budget) {
+				out.push_back(in);
+				continue;
+			}
+			// the callee's argument k is local base + k, its local k is local base + nArgs + k
+			const VMCode& callee = codes[s.file];
+			int base = me->locals, save = base + in.arg + s.locals, end = -1;
+			bool restore = s.setsThis && me->usesThis;
+			string prefix = "INLINE" + to_string(site++) + "_";
+			size_t start = out.size();
+			for (int k = in.arg - 1; k >= 0; k--)
+				out.push_back(VMInstr{ OP_POP, SEG_LOCAL, base + k, -1 });
+			for (int k = 0; k < s.locals; k++) {
+				out.push_back(VMInstr{ OP_PUSH, SEG_CONST, 0, -1 });
+				out.push_back(VMInstr{ OP_POP, SEG_LOCAL, base + in.arg + k, -1 });
+			}
+			if (restore) {
+				out.push_back(VMInstr{ OP_PUSH, SEG_POINTER, 0, -1 });
+				out.push_back(VMInstr{ OP_POP, SEG_LOCAL, save, -1 });
+			}
+			for (int k = s.entry + 1; k < s.end; k++) {
+				VMInstr b = callee.code[k];
+				if ((b.op == OP_PUSH || b.op == OP_POP) && b.seg == SEG_ARG) {
+					b.seg = SEG_LOCAL;
+					b.arg += base;
+				}
+				else if ((b.op == OP_PUSH || b.op == OP_POP) && b.seg == SEG_LOCAL)
+					b.arg += base + in.arg;
+				else if (b.op == OP_LABEL || b.op == OP_GOTO || b.op == OP_IF || b.op == OP_IFNOT)
+					b.name = caller.name(prefix + string(callee.nameOf(b.name)));
+				else if (b.op == OP_CALL)
+					b.name = caller.name(callee.nameOf(b.name));
+				else if (b.op == OP_RETURN) {
+					if (k == s.end - 1)
+						continue;	// the value is on the stack, where the call would have left it
+					if (end < 0)
+						end = caller.name(prefix + "END");
+					b = VMInstr{ OP_GOTO, SEG_NONE, 0, end };
+				}
+				out.push_back(b);
+			}
+			if (end >= 0)
+				out.push_back(VMInstr{ OP_LABEL, SEG_NONE, 0, end });
+			if (restore) {
+				out.push_back(VMInstr{ OP_PUSH, SEG_LOCAL, save, -1 });
+				out.push_back(VMInstr{ OP_POP, SEG_POINTER, 0, -1 });
+			}
+			extra = max(extra, in.arg + s.locals + (restore ? 1 : 0));
+			budget -= out.size() - start - 1;
+			inlined++;
+		}
+		if (me)
+			out[head].arg += extra;
+	}
+	// the index points into the old code until every class is done
+	for (int f = 0; f < (int)codes.size(); f++) {
+		codes[f].code.swap(result[f]);
+		if (opt.peephole)
+			codes[f].peephole(opt.peephole);
+	}
+}
+
+void JackAnalyzer::prune(string input, vector<VMCode>& codes) {
+	/*
+	*	Jack has no function pointers, so the call instructions are the whole call graph.
+	*	The program starts at Sys.init when anything defines it, else at Main.main. The
+	*	.vm files with no .jack next to them (e.g. the OS) are part of the graph but are
+	*	not rewritten here; link() drops their dead functions from the .asm.
+	*/
+	unordered_map<string, vector<string>> calls;	// function -> what it calls
+	vector<string> files = extraFiles(input);
+	vector<VMCode> extra(files.size());
+	vector<string> work;
+
+	for (size_t i = 0; i < files.size(); i++)
+		readVM(files[i], extra[i]);
+	for (vector<VMCode>* group : { &codes, &extra }) {
+		for (const VMCode& code : *group) {
+			vector<string>* callees = nullptr;
+			for (const VMInstr& in : code.code) {
+				if (in.op == OP_FUNCTION)
+					callees = &calls[string(code.nameOf(in.name))];
+				else if (in.op == OP_CALL && callees)
+					callees->push_back(string(code.nameOf(in.name)));
+			}
+		}
+	}
+	if (calls.count("Sys.init"))
+		work.push_back("Sys.init");
+	else if (calls.count("Main.main"))
+		work.push_back("Main.main");
+	else
+		throw runtime_error("prune: neither Sys.init nor Main.main is defined");
+	live.clear();
+	live.insert(work[0]);
+	while (!work.empty()) {
+		string f = work.back();
+		work.pop_back();
+		for (const string& g : calls[f]) {
+			if (live.insert(g).second)
+				work.push_back(g);
+		}
+	}
+	for (VMCode& code : codes)
+		dropDead(code);
+}
+
+void JackAnalyzer::dropDead(VMCode& code) {
+	size_t kept = 0;
+	bool keep = true;
+
+	for (size_t i = 0; i < code.code.size(); i++) {
+		const VMInstr& in = code.code[i];
+		if (in.op == OP_FUNCTION) {
+			string name(code.nameOf(in.name));
+			keep = live.count(name) != 0;
+			if (!keep)
+				removed.push_back(name);
+		}
+		if (keep)
+			code.code[kept++] = in;
+	}
+	code.code.resize(kept);
+}
+
+void JackAnalyzer::link(string input, vector<string>& hack) {
+	/*
+	*	A directory is a whole program: bootstrap first, then every class, then any .vm
+	*	or .vmb file without a .jack source next to it (e.g. the OS), then the shared
+	*	routines. Where both Xxx.vm and Xxx.vmb are there, the .vmb is used.
+	*	A single file is translated on its own, with no bootstrap.
+	*/
+	CodeWriter W(opt.trampolines);
+	string path;
+	if (filesystem::is_directory(input)) {
+		filesystem::path dir(input);
+		W.writeInit();
+		for (const string& h : hack)
+			W.text() += h;
+		for (const string& f : extraFiles(input)) {
+			VMCode code;
+			readVM(f, code);
+			if (opt.prune)
+				dropDead(code);
+			W.setFileName(filesystem::path(f).stem().string());
+			W.write(code);
+		}
+		dir = filesystem::absolute(dir).lexically_normal();
+		if (!dir.has_filename())
+			dir = dir.parent_path();	// trailing separator
+		path = (dir / (dir.filename().string() + ".asm")).string();
+	}
+	else {
+		W.text() += hack[0];
+		path = input.substr(0, input.length() - 5) + ".asm";
+	}
+	W.writeRoutines();
+	W.close(path);
+}
+
+struct JackAnalyzer::Context {
+	JackTokenizer T;
+	CompilationEngine<VMOnly> C;
+	Context() : C(Options()) {}
+};
+
+const VMCode& JackAnalyzer::compileSourceIR(string_view source, const Options& opt) {
+	static thread_local Context ctx;
+	ctx.T.reset(source);
+	ctx.C.reset(&ctx.T, string(), opt);
+	ctx.C.compile();
+	return ctx.C.finish();
+}
+
+const VMCode& JackAnalyzer::compileSourceIR(string_view source) {
+	return compileSourceIR(source, Options());
+}
+
+void JackAnalyzer::compileSource(string_view source, string& vm, const Options& opt) {
+	compileSourceIR(source, opt).print(vm);
+}
+
+void JackAnalyzer::compileSource(string_view source, string& vm) {
+	compileSource(source, vm, Options());
+}
+
+string JackAnalyzer::stamp() {
+	return string(compilerVersion) + " peephole=" + to_string(opt.peephole) + " fold=" + to_string(opt.fold) + " reduce=" + to_string(opt.reduce) + " tail=" + to_string(opt.tailCalls) + " pool=" + to_string(opt.pool) + " binary=" + to_string(opt.binary);
+}
+
+int JackAnalyzer::failures() {
+	return (int)errors.size();
+}
+
+int JackAnalyzer::reused() {
+	return skipped;
+}
+
+const vector<string>& JackAnalyzer::pruned() {
+	return removed;
+}
+
+#ifdef JACK_STATS
+void JackAnalyzer::writeStats(ostream& out) {
+	JackStats::writeJSON(out, stamp(), opt.jobs > 0 ? opt.jobs : (int)thread::hardware_concurrency(), wallMs, stats);
+}
+#endif
+
+/* BUILD CACHE FUNCTIONS */
+JackAnalyzer::BuildCache::BuildCache(string dir, string stamp, string ext) {
+	string line, name;
+	uint64_t jackHash, vmHash;
+
+	this->stamp = stamp;
+	this->ext = ext;
+	path = (filesystem::path(dir) / ".jackcache").string();
+	dirty = false;
+	ifstream in(path);
+	if (!getline(in, line) || line != stamp)
+		return;	// missing or written by another compiler: start over
+	while (in >> name >> hex >> jackHash >> vmHash)
+		entries[name] = make_pair(jackHash, vmHash);
+}
+
+bool JackAnalyzer::BuildCache::upToDate(string jackFile, uint64_t& jackHash) {
+	string name = filesystem::path(jackFile).filename().string();
+	uint64_t vmHash;
+	pair<uint64_t, uint64_t> e;
+
+	if (!hashFile(jackFile, jackHash))
+		throw runtime_error("cannot open " + jackFile);
+	{
+		lock_guard<mutex> lock(m);
+		unordered_map<string, pair<uint64_t, uint64_t>>::iterator it = entries.find(name);
+		if (it == entries.end())
+			return false;
+		e = it->second;
+	}
+	// the .vm must still be the one we wrote; hand edits or deletes force a rebuild
+	return e.first == jackHash &&
+		hashFile(jackFile.substr(0, jackFile.length() - 5) + ext, vmHash) && e.second == vmHash;
+}
+
+void JackAnalyzer::BuildCache::record(string jackFile, uint64_t jackHash) {
+	string name = filesystem::path(jackFile).filename().string();
+	uint64_t vmHash;
+
+	if (!hashFile(jackFile.substr(0, jackFile.length() - 5) + ext, vmHash))
+		return;
+	lock_guard<mutex> lock(m);
+	entries[name] = make_pair(jackHash, vmHash);
+	dirty = true;
+}
+
+void JackAnalyzer::BuildCache::keepOnly(const vector<string>& jackFiles) {
+	unordered_map<string, pair<uint64_t, uint64_t>> kept;
+
+	for (const string& f : jackFiles) {
+		string name = filesystem::path(f).filename().string();
+		if (entries.count(name))
+			kept[name] = entries[name];
+	}
+	if (kept.size() != entries.size())
+		dirty = true;
+	entries.swap(kept);
+}
+
+void JackAnalyzer::BuildCache::save() {
+	vector<string> names;
+
+	if (!dirty)
+		return;
+	for (const auto& e : entries)
+		names.push_back(e.first);
+	sort(names.begin(), names.end());
+	// write a temp file and rename it over the old one so a crash never leaves half a manifest
+	ofstream out(path + ".tmp");
+	out << stamp << '\n' << hex;
+	for (const string& n : names)
+		out << n << ' ' << entries[n].first << ' ' << entries[n].second << '\n';
+	out.close();
+	error_code ec;
+	filesystem::rename(path + ".tmp", path, ec);
+}
+
+bool JackAnalyzer::BuildCache::hashFile(string path, uint64_t& hash) {
+	ifstream in(path, ios::binary);
+	char buf[1 << 16];
+
+	if (!in)
+		return false;
+	hash = 14695981039346656037ull;	// FNV-1a
+	while (in.read(buf, sizeof buf) || in.gcount() > 0) {
+		for (streamsize i = 0; i < in.gcount(); i++)
+			hash = (hash ^ (unsigned char)buf[i]) * 1099511628211ull;
+	}
+	return true;
+}
+
+/* THREAD POOL FUNCTIONS */
+JackAnalyzer::ThreadPool::ThreadPool(int workers) {
+	if (workers <= 0)
+		workers = (int)thread::hardware_concurrency();
+	this->workers = max(workers, 1);
+}
+
+void JackAnalyzer::ThreadPool::run(int n, function<void(int)> job) {
+	struct queue {
+		mutex m;
+		deque<int> jobs;
+	};
+	int w = min(workers, n);
+	vector<queue> queues(max(w, 1));
+	vector<thread> threads;
+
+	for (int i = 0; i < n; i++)
+		queues[i % queues.size()].jobs.push_back(i);
+	// no job adds more work, so once every deque is empty we are done
+	auto work = [&](int self) {
+		int j;
+		for (;;) {
+			bool found = false;
+			for (int k = 0; k < (int)queues.size() && !found; k++) {
+				queue& q = queues[(self + k) % queues.size()];
+				lock_guard<mutex> lock(q.m);
+				if (q.jobs.empty())
+					continue;
+				if (k == 0) {	// own deque: in the order dealt, so the biggest jobs start first
+					j = q.jobs.front();
+					q.jobs.pop_front();
+				}
+				else {	// steal the smallest job left to another worker
+					j = q.jobs.back();
+					q.jobs.pop_back();
+				}
+				found = true;
+			}
+			if (!found)
+				return;
+			job(j);
+		}
+	};
+	for (int t = 1; t < w; t++)
+		threads.emplace_back(work, t);
+	work(0);
+	for (thread& t : threads)
+		t.join();
 }
 
 /*JACK TOKENIZER FUNCTIONS*/
-JackAnalyzer::JackTokenizer::JackTokenizer(string filename) {
-	jackFile.open(filename);
-	curTokn = t = "";
+static unsigned hashName(const char* s, size_t len) {	// FNV-1a
+	unsigned h = 2166136261u;
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ (unsigned char)s[i]) * 16777619u;
+	return h;
+}
+
+JackAnalyzer::JackTokenizer::JackTokenizer(string filename, bool buffered) {
+	STAT_TIMER(lexNs);
+	this->buffered = buffered;
+	p = end = nullptr;
+	if (!buffered) {
+		jackFile.open(filename);
+		if (!jackFile)
+			throw runtime_error("cannot open " + filename);
+	}
+	else {
+		// read the whole file in one go; binary so the size matches what we read
+		ifstream in(filename, ios::binary);
+		if (!in)
+			throw runtime_error("cannot open " + filename);
+		in.seekg(0, ios::end);
+		src.resize((size_t)in.tellg());
+		in.seekg(0, ios::beg);
+		in.read(&src[0], src.size());
+		src.resize((size_t)in.gcount());
+		p = src.data();
+		end = p + src.size();
+	}
+
+	lex();
+}
+
+JackAnalyzer::JackTokenizer::JackTokenizer() {
+	buffered = true;
+	p = end = nullptr;
+	addToken(SYMBOL, 0, 0, '\0');
+	cur = 0;
+	next = 0;
+}
+
+void JackAnalyzer::JackTokenizer::reset(string_view source) {
+	STAT_TIMER(lexNs);
+	buffered = true;
+	src.assign(source.data(), source.size());	// all of these keep their capacity from the last source
+	kinds.clear();
+	offs.clear();
+	lens.clear();
+	ids.clear();
+	nameOffs.clear();
+	nameLens.clear();
+	fill(nameSlots.begin(), nameSlots.end(), -1);
+	p = src.data();
+	end = p + src.size();
+	lex();
+}
+
+void JackAnalyzer::JackTokenizer::lex() {
+	// lexing pass: fill the token arrays for the whole file
+	kinds.reserve(src.size() / 4 + 16);
+	offs.reserve(src.size() / 4 + 16);
+	lens.reserve(src.size() / 4 + 16);
+	ids.reserve(src.size() / 4 + 16);
+	while (buffered ? scanBuffer() : scanStream())
+		;
+	addToken(SYMBOL, 0, 0, '\0');	// sentinel: current token before the first advance() and past the end
+	cur = (int)kinds.size() - 1;
+	STAT_ADD(tokens, cur);
+	next = 0;
+}
+
+int JackAnalyzer::JackTokenizer::tokenCount() {
+	return (int)kinds.size() - 1;	// not the sentinel
 }
 
-bool JackAnalyzer::JackTokenizer::hasMoreTokens() {	// just checks for eof?
-	char c = jackFile.peek();
-	return !(c == EOF);
+bool JackAnalyzer::JackTokenizer::hasMoreTokens() {
+	return next < (int)kinds.size() - 1;
 }
 
 void JackAnalyzer::JackTokenizer::advance() {
-	char c;
-	// check if more tokens
-	if (!hasMoreTokens())
+	// past the last token the sentinel is current, so a missing token reads as the end of the file
+	if (!hasMoreTokens()) {
+		cur = (int)kinds.size() - 1;
 		return;
+	}
+	cur = next++;
+}
+
+void JackAnalyzer::JackTokenizer::skip(char symbol) {
+	if (kinds[cur] != SYMBOL || (char)ids[cur] != symbol)
+		throw runtime_error(string("expected '") + symbol + "' but found " + found());
+	advance();
+}
+
+string JackAnalyzer::JackTokenizer::found() {
+	if (cur == (int)kinds.size() - 1)
+		return "end of file";
+	return '\'' + string(tokenText()) + '\'';
+}
+
+void JackAnalyzer::JackTokenizer::addToken(TOKENTYPE type, size_t off, size_t len, int id) {
+	kinds.push_back((unsigned char)type);
+	offs.push_back((unsigned)off);
+	lens.push_back((unsigned)len);
+	ids.push_back(id);
+}
 
-	// clear curTokn
-	curTokn.clear();
-	// get first character
-	jackFile.get(c);
-	while (c == ' ' || c == '\t' || c == '\n')	// ignore whitespace, tab, newline
-		jackFile.get(c);
-	curTokn.push_back(c);
+bool JackAnalyzer::JackTokenizer::scanStream() {
+	string tokn;
+	char c;
+	size_t off;
+	KEYWORDTYPE kw;
 
+	// skip whitespace and comments
+	for (;;) {
+		if (!jackFile.get(c))
+			return false;
+		if (c == ' ' || c == '\t' || c == '\n' || c == '\r')	// ignore whitespace, tab, newline
+			continue;
+		if (c == '/' && jackFile.peek() == '/') {
+			while (jackFile.peek() != '\n' && jackFile.peek() != EOF)	// go to before end of line char
+				jackFile.get(c);
+			continue;
+		}
+		if (c == '/' && jackFile.peek() == '*') {
+			jackFile.get(c);	// consume *
+			if (jackFile.peek() == '*')
+				jackFile.get(c);	// consume extra * for API comment
+			jackFile.get(c);	// go to next character
+			while (c != '*') {	// go before closing forward slash
+				jackFile.get(c);
+				if (jackFile.peek() == '*') {
+					jackFile.get(c);
+					if (jackFile.peek() != '/')
+						jackFile.get(c);
+				}
+			}
+			jackFile.get(c);	// consume closing slash
+			continue;
+		}
+		break;
+	}
+
+	off = src.size();
+	tokn.push_back(c);
 	if (isdigit(c)) {/* tokenize int_const */
-		t = "int_const";
 		while (isdigit(jackFile.peek())) {
 			jackFile.get(c);
-			curTokn.push_back(c);
+			tokn.push_back(c);
 		}
+		src += tokn;
+		addToken(INT_CONST, off, tokn.size(), stoi(tokn));
 	}
 	else if (isalpha(c) || c == '_') {		/* tokenize keyword or identifier */
 		while (isalpha(jackFile.peek()) || jackFile.peek() == '_' || isdigit(jackFile.peek())) {
 			jackFile.get(c);
-			curTokn.push_back(c);
+			tokn.push_back(c);
 		}
-		t = keyOrIdent();
+		src += tokn;
+		kw = keyOrIdent(tokn);
+		if (kw == K_NONE)
+			addToken(IDENTIFIER, off, tokn.size(), internAt(off, tokn.size()));
+		else
+			addToken(KEYWORD, off, tokn.size(), kw);
 	}
 	else if (c == '\"') {	/* tokenize string constant */
-		t = "string_constant";
-		while (jackFile.peek() != '\"') {
+		tokn.clear();
+		while (jackFile.peek() != '\"' && jackFile.peek() != EOF) {
 			jackFile.get(c);
-			curTokn.push_back(c);
+			tokn.push_back(c);
 		}
 		jackFile.get(c);	// consume ending double quote
-		curTokn = curTokn.substr(1, curTokn.length() - 1);
+		src += tokn;
+		addToken(STRING_CONST, off, tokn.size(), 0);
 	}
-	/* watching out for comments */
-	else if (c == '/' && jackFile.peek() == '/') {
-		curTokn.clear();
-		while (jackFile.peek() != '\n')	// go to before end of line char
-			jackFile.get(c);
-		this->advance();
-	}
-	else if (c == '/' && jackFile.peek() == '*') {
-		curTokn.clear();
-		jackFile.get(c);	// consume *
-		if (jackFile.peek() == '*')
-			jackFile.get(c);	// consume extra * for API comment
-		jackFile.get(c);	// go to next character
-		while (c != '*') {	// go before closing forward slash
-			jackFile.get(c);
-			if (jackFile.peek() == '*') {
-				jackFile.get(c);
-				if (jackFile.peek() != '/')
-					jackFile.get(c);
-			}
+	else {
+		src += tokn;
+		addToken(SYMBOL, off, 1, c);
+	}
+	return true;
+}
+
+bool JackAnalyzer::JackTokenizer::scanBuffer() {
+	const char* s;
+	KEYWORDTYPE kw;
+	int v;
+
+	// skip whitespace and comments
+	for (;;) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+			p++;
+		if (p == end)
+			return false;
+		if (*p != '/' || p + 1 == end)
+			break;
+		if (p[1] == '/') {
+			while (p < end && *p != '\n')
+				p++;
 		}
-		jackFile.get(c);	// consume closing slash
-		this->advance();
+		else if (p[1] == '*') {	// also covers /** API comments */
+			p += 2;
+			while (p + 1 < end && !(p[0] == '*' && p[1] == '/'))
+				p++;
+			p = (p + 1 < end) ? p + 2 : end;
+		}
+		else
+			break;
+	}
+
+	s = p;
+	if (isdigit((unsigned char)*p)) {	/* tokenize int_const */
+		v = 0;
+		while (p < end && isdigit((unsigned char)*p))
+			v = v * 10 + (*p++ - '0');
+		addToken(INT_CONST, s - src.data(), p - s, v);
 	}
-	else if (curTokn.find_first_of("{}()[].,;+-*/&|<>=~") != string::npos)	// symbol
-		t = "symbol";
+	else if (isalpha((unsigned char)*p) || *p == '_') {	/* tokenize keyword or identifier */
+		while (p < end && (isalnum((unsigned char)*p) || *p == '_'))
+			p++;
+		kw = keyOrIdent(string_view(s, p - s));
+		if (kw == K_NONE)
+			addToken(IDENTIFIER, s - src.data(), p - s, internAt(s - src.data(), p - s));
+		else
+			addToken(KEYWORD, s - src.data(), p - s, kw);
+	}
+	else if (*p == '\"') {	/* tokenize string constant */
+		s = ++p;
+		while (p < end && *p != '\"')
+			p++;
+		addToken(STRING_CONST, s - src.data(), p - s, 0);
+		if (p < end)
+			p++;	// consume ending double quote
+	}
+	else {
+		p++;
+		addToken(SYMBOL, s - src.data(), 1, *s);
+	}
+	return true;
 }
 
-string JackAnalyzer::JackTokenizer::keyOrIdent() {
-	if (curTokn == "class" || curTokn == "constructor" || curTokn == "function" ||
-		curTokn == "method" || curTokn == "field" || curTokn == "static" || curTokn == "var" ||
-		curTokn == "int" || curTokn == "char" || curTokn == "boolean" || curTokn == "void" || curTokn == "true" ||
-		curTokn == "false" || curTokn == "null" || curTokn == "this" || curTokn == "let" || curTokn == "do" ||
-		curTokn == "if" || curTokn == "else" || curTokn == "while" || curTokn == "return")
-		return "keyword";
-	else
-		return "identifier";
+int JackAnalyzer::JackTokenizer::internAt(size_t off, size_t len) {
+	size_t mask, i;
+	int id;
+
+	// keep the table at most half full
+	if (nameSlots.size() < 2 * (nameOffs.size() + 1)) {
+		vector<int> old(max<size_t>(64, nameSlots.size() * 2), -1);
+		old.swap(nameSlots);
+		mask = nameSlots.size() - 1;
+		for (int n : old) {
+			if (n < 0)
+				continue;
+			for (i = hashName(src.data() + nameOffs[n], nameLens[n]) & mask; nameSlots[i] >= 0; i = (i + 1) & mask)
+				;
+			nameSlots[i] = n;
+		}
+	}
+	mask = nameSlots.size() - 1;
+	for (i = hashName(src.data() + off, len) & mask; (id = nameSlots[i]) >= 0; i = (i + 1) & mask) {
+		if (nameLens[id] == len && src.compare(nameOffs[id], len, src, off, len) == 0)
+			return id;
+	}
+	id = (int)nameOffs.size();
+	nameOffs.push_back((unsigned)off);
+	nameLens.push_back((unsigned)len);
+	nameSlots[i] = id;
+	return id;
 }
 
-string JackAnalyzer::JackTokenizer::tokenType() {
-	return t;
+int JackAnalyzer::JackTokenizer::intern(string_view name) {
+	size_t off = src.size();
+	int id;
+
+	// append, then drop the copy again if the name was already known
+	src.append(name.data(), name.size());
+	id = internAt(off, name.size());
+	if (nameOffs[id] != off)
+		src.resize(off);
+	return id;
 }
 
-std::string JackAnalyzer::JackTokenizer::keyWord() {
-	return curTokn;
+string_view JackAnalyzer::JackTokenizer::name(int id) {
+	return string_view(src.data() + nameOffs[id], nameLens[id]);
+}
+
+JackAnalyzer::KEYWORDTYPE JackAnalyzer::JackTokenizer::keyOrIdent(string_view word) {
+	/*
+	*	perfect hash over the 21 keywords: (length + 6 * first + last) mod 64 gives each keyword
+	*	its own slot, so a lookup is one hash, one length check and one compare
+	*/
+	struct slot {
+		string_view word;
+		KEYWORDTYPE kw;
+	};
+	constexpr slot keywords[] = {
+		{ "class", K_CLASS }, { "method", K_METHOD }, { "function", K_FUNCTION },
+		{ "constructor", K_CONSTRUCTOR }, { "int", K_INT }, { "boolean", K_BOOLEAN },
+		{ "char", K_CHAR }, { "void", K_VOID }, { "var", K_VAR }, { "static", K_STATIC },
+		{ "field", K_FIELD }, { "let", K_LET }, { "do", K_DO }, { "if", K_IF },
+		{ "else", K_ELSE }, { "while", K_WHILE }, { "return", K_RETURN }, { "true", K_TRUE },
+		{ "false", K_FALSE }, { "null", K_NULL }, { "this", K_THIS }
+	};
+	constexpr auto hash = [](string_view w) {
+		return (w.size() + 6 * (unsigned char)w.front() + (unsigned char)w.back()) & 63;
+	};
+	struct table {
+		slot slots[64];
+		bool perfect;
+	};
+	constexpr table T = [&]() {
+		table t = {};
+		t.perfect = true;
+		for (slot& s : t.slots)
+			s.kw = K_NONE;
+		for (const slot& k : keywords) {
+			size_t h = hash(k.word);
+			if (!t.slots[h].word.empty())
+				t.perfect = false;
+			t.slots[h] = k;
+		}
+		return t;
+	}();
+	static_assert(T.perfect, "keyword hash has a collision");
+
+	if (word.empty())
+		return K_NONE;
+	const slot& s = T.slots[hash(word)];
+	return (s.word == word) ? s.kw : K_NONE;
+}
+
+JackAnalyzer::TOKENTYPE JackAnalyzer::JackTokenizer::tokenType() {
+	return (TOKENTYPE)kinds[cur];
+}
+
+JackAnalyzer::KEYWORDTYPE JackAnalyzer::JackTokenizer::keyWord() {
+	return kinds[cur] == KEYWORD ? (KEYWORDTYPE)ids[cur] : K_NONE;
 }
 
 char JackAnalyzer::JackTokenizer::symbol() {
-	return curTokn[0];
+	return kinds[cur] == SYMBOL ? (char)ids[cur] : src[offs[cur]];
 }
 
-std::string JackAnalyzer::JackTokenizer::identifier() {
-	return curTokn;
+string_view JackAnalyzer::JackTokenizer::identifier() {
+	return tokenText();
 }
 
 int JackAnalyzer::JackTokenizer::intVal() {
-	return stoi(curTokn);
+	return ids[cur];
+}
+
+string_view JackAnalyzer::JackTokenizer::stringVal() {
+	return tokenText();
+}
+
+string_view JackAnalyzer::JackTokenizer::tokenText() {
+	return string_view(src.data() + offs[cur], lens[cur]);
+}
+
+string_view JackAnalyzer::JackTokenizer::tokenText(int token) {
+	return string_view(src.data() + offs[token], lens[token]);
+}
+
+int JackAnalyzer::JackTokenizer::position() {
+	return cur;
+}
+
+int JackAnalyzer::JackTokenizer::identifierId() {
+	return ids[cur];
+}
+
+JackAnalyzer::TOKENTYPE JackAnalyzer::JackTokenizer::peekType(int n) {
+	return (TOKENTYPE)kinds[min(cur + n, (int)kinds.size() - 1)];
 }
 
-std::string JackAnalyzer::JackTokenizer::stringVal() {
-	return curTokn;
+char JackAnalyzer::JackTokenizer::peekSymbol(int n) {
+	int i = min(cur + n, (int)kinds.size() - 1);
+	return kinds[i] == SYMBOL ? (char)ids[i] : '\0';
 }
 
 /*COMPILATION ENGINE FUNCTIONS*/
@@ -139,542 +1020,1662 @@ std::string JackAnalyzer::JackTokenizer::stringVal() {
 // integrate symbol tables into compilation engine
 // then, use compilation engine to send commands to VMWriter to produce final vm code
 
-JackAnalyzer::CompilationEngine::CompilationEngine(JackTokenizer* T, string output) {
+static bool isOp(char c) {	// binary operator symbol? ('\0' past the end is not)
+	switch (c) {
+	case '+': case '-': case '*': case '/': case '&': case '|': case '<': case '>': case '=':
+		return true;
+	default:
+		return false;
+	}
+}
+
+template <class Output>
+JackAnalyzer::CompilationEngine<Output>::CompilationEngine(const Options& opt) {
+	T = nullptr;
+	this->opt = opt;
+	labelCount = 0;
+}
+
+template <class Output>
+JackAnalyzer::CompilationEngine<Output>::CompilationEngine(JackTokenizer* T, string output, const Options& opt) {
+	reset(T, output, opt);
+}
+
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::reset(JackTokenizer* T, string output, const Options& opt) {
 	this->T = T;
-	argCount = 0;
-	outFile.open(output + ".xml");
-	vm = new VMWriter(output + ".vm");
-	while (T->tokenType() != "keyword" && T->keyWord() != "class")
+	this->opt = opt;
+	labelCount = 0;
+	table.reset();
+	exprStack.clear();	// frames a parse error may have left behind
+	genStack.clear();
+	vm.reset(output.empty() ? output : output + (opt.binary ? ".vmb" : ".vm"), opt.peephole, opt.binary);
+	xml.reset(output.empty() ? output : output + ".xml");
+}
+
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::compile() {
+	STAT_TIMER(parseNs);
+	while (T->hasMoreTokens() && !(T->tokenType() == KEYWORD && T->keyWord() == K_CLASS))
 		T->advance();
-	outFile << "<class>\n";
+	if (!(T->tokenType() == KEYWORD && T->keyWord() == K_CLASS))
+		throw runtime_error("expected 'class' but found " + T->found());
+	if constexpr (!Output::xml) {
+		if (opt.ast) {	// whole class into a tree first, then code from the tree
+			arena.reset();
+			genClass(ASTParser(T, &arena).parseClass());
+			return;
+		}
+	}
 	CompileClass();
-	outFile << "</class>\n";
 }
 
-void JackAnalyzer::CompilationEngine::CompileClass() {
-//	outFile << '<' + T->tokenType() + "> " + T->keyWord() + " </" + T->tokenType() + ">\n";
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::close() {
+	if constexpr (Output::vm) {
+		if (!opt.prune && !opt.inlineSize && (!opt.hack || opt.keepVM))	// whole-program passes: the analyzer writes it once every class is in
+			vm.close();
+	}
+	xml.write();
+}
+
+template <class Output>
+const VMCode& JackAnalyzer::CompilationEngine<Output>::finish() {
+	if constexpr (Output::vm) {
+		vm.finish();
+		return vm.code;
+	}
+	else
+		throw logic_error("no VM code is built for XML output only");
+}
+
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::CompileClass() {
+	xml.open("class");
+	xml.token(T);
 	T->advance();
-//	outFile << '<' + T->tokenType() + "> " + T->identifier() + " </" + T->tokenType() + ">\n";
-	className = T->identifier();
+	xml.token(T);
+	className = string(T->identifier());
 	T->advance();
-//	outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
+	xml.token(T);
 	// classVarDec call
-	T->advance();
-	while (T->tokenType() == "keyword" && (T->keyWord() == "static" ||T->keyWord()== "field"))
+	T->skip('{');
+	while (T->tokenType() == KEYWORD && (T->keyWord() == K_STATIC || T->keyWord() == K_FIELD))
 		CompileClassVarDec();
+	// pooled literals go after the declared statics
+	literals.clear();
+	poolOrder.clear();
+	poolBase = table.VarCount(STATIC) + 1;
 	// subroutineDec call
-	while (T->tokenType() == "keyword" && 
-		(T->keyWord() == "constructor" ||T->keyWord()== "function" || T->keyWord() == "method"))
+	while (T->tokenType() == KEYWORD && 
+		(T->keyWord() == K_CONSTRUCTOR || T->keyWord() == K_FUNCTION || T->keyWord() == K_METHOD))
 		CompileSubroutine();
-//	outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
+	if (!poolOrder.empty())
+		writePoolInit();
+	xml.token(T);
+	T->skip('}');
+	xml.close("class");
 }
 
-void JackAnalyzer::CompilationEngine::CompileClassVarDec() {
-	string name, type;
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::CompileClassVarDec() {
+	int type;
 	JackAnalyzer::KIND kind;
 
-	if (T->keyWord() == "static")
+	if (T->keyWord() == K_STATIC)
 		kind = JackAnalyzer::STATIC;
 	else
 		kind = JackAnalyzer::FIELD;
-//	outFile << '<' + T->tokenType() + "> " + T->keyWord() + " </" + T->tokenType() + ">\n";
+	xml.open("classVarDec");
+	xml.token(T);
 	T->advance();
 
-	type = T->keyWord();
+	type = T->intern(T->tokenText());
 	writeType();
 
-	name = T->identifier();
-	table.Define(name, type, kind);		// add to symbol table
+	table.Define(T->identifierId(), type, kind);		// add to symbol table
 
-//	outFile << '<' + T->tokenType() + "> " + T->identifier() + " </" + T->tokenType() + ">\n";
+	xml.token(T);
 	T->advance();
-	while (T->tokenType() == "symbol" && T->symbol() == ',') {
-//		outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
+	while (T->tokenType() == SYMBOL && T->symbol() == ',') {
+		xml.token(T);
 		T->advance();
-		name = T->identifier();
-		table.Define(name, type, kind);		// add to symbol table
-//		outFile << '<' + T->tokenType() + "> " + T->identifier() + " </" + T->tokenType() + ">\n";
+		table.Define(T->identifierId(), type, kind);		// add to symbol table
+		xml.token(T);
 		T->advance();
 	}
-//	outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
-	T->advance();
+	xml.token(T);
+	T->skip(';');
+	xml.close("classVarDec");
 }
 
-void JackAnalyzer::CompilationEngine::CompileSubroutine() {
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::CompileSubroutine() {
 	string functionName;
+	size_t start;
+	KEYWORDTYPE kind = T->keyWord();
 	table.startSubroutine();	// clear subroutine table
+	labelCount = 0;
+	usesPool = false;
 	// add this 0 to symbol table if function is a method
-	if(T->keyWord() == "method")
-		table.Define("this", className, JackAnalyzer::ARG);
+	if(kind == K_METHOD)
+		table.Define(T->intern("this"), T->intern(className), JackAnalyzer::ARG);
 
-//	outFile << '<' + T->tokenType() + "> " + T->keyWord() + " </" + T->tokenType() + ">\n";
+	xml.open("subroutineDec");
+	xml.token(T);
 	T->advance();
 	writeType();
-//	outFile << '<' + T->tokenType() + "> " + T->identifier() + " </" + T->tokenType() + ">\n";
-	functionName = className + '.' + T->identifier();
-	T->advance();
-//	outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
+	xml.token(T);
+	functionName = className + '.';
+	functionName += T->identifier();
 	T->advance();
+	xml.token(T);
+	T->skip('(');
 	
-	// parameter list
-	if (T->tokenType() == "keyword")
+	// parameter list; types may be class names, so anything but ) starts one
+	xml.open("parameterList");
+	if (!(T->tokenType() == SYMBOL && T->symbol() == ')'))
 		compileParameterList();
-//	outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
-	T->advance();
+	xml.close("parameterList");
+	xml.token(T);
+	T->skip(')');
 
 	//subroutine body
-//	outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
-	T->advance();
+	xml.open("subroutineBody");
+	xml.token(T);
+	T->skip('{');
 	// varDec*
-	while (T->tokenType() == "keyword" && T->keyWord() == "var")
+	while (T->tokenType() == KEYWORD && T->keyWord() == K_VAR)
 		compileVarDec();
 	// write vmFunction call
-	vm->writeFunction(functionName, table.VarCount(VAR));
+	start = writePrologue(kind, functionName);
 	// compile statements
 	compileStatements();
-//	outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
-	T->advance();
+	writePoolGuard(start);
+	xml.token(T);
+	T->skip('}');
+	xml.close("subroutineBody");
+	xml.close("subroutineDec");
 }
 
-void JackAnalyzer::CompilationEngine::compileParameterList() {
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::compileParameterList() {
 	JackAnalyzer::KIND k = ARG;
-	string name, type;
-	type = T->keyWord();
+	int type;
+	type = T->intern(T->tokenText());
 	writeType();
-	name = T->identifier();
-	table.Define(name, type, k);
-//	outFile << '<' + T->tokenType() + "> " + T->identifier() + " </" + T->tokenType() + ">\n";
+	table.Define(T->identifierId(), type, k);
+	xml.token(T);
 	T->advance();
-	while (T->tokenType() == "symbol" && T->symbol() == ',') {
-//		outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
+	while (T->tokenType() == SYMBOL && T->symbol() == ',') {
+		xml.token(T);
 		T->advance();
-		type = T->keyWord();
+		type = T->intern(T->tokenText());
 		writeType();
-		name = T->identifier();
-		table.Define(name, type, k);
-//		outFile << '<' + T->tokenType() + "> " + T->identifier() + " </" + T->tokenType() + ">\n";
+		table.Define(T->identifierId(), type, k);
+		xml.token(T);
 		T->advance();
 	}
 }
 
-void JackAnalyzer::CompilationEngine::compileVarDec() {
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::compileVarDec() {
 	JackAnalyzer::KIND k = VAR;
-	string name, type;
-//	outFile << '<' + T->tokenType() + "> " + T->keyWord() + " </" + T->tokenType() + ">\n";
+	int type;
+	xml.open("varDec");
+	xml.token(T);
 	T->advance();
-	type = T->keyWord();
+	type = T->intern(T->tokenText());
 	writeType();
-	name = T->identifier();
-	table.Define(name, type, k);
+	table.Define(T->identifierId(), type, k);
 
-//	outFile << '<' + T->tokenType() + "> " + T->identifier() + " </" + T->tokenType() + ">\n";
+	xml.token(T);
 	T->advance();
-	while (T->tokenType() == "symbol" && T->symbol() == ',') {
-//		outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
+	while (T->tokenType() == SYMBOL && T->symbol() == ',') {
+		xml.token(T);
 		T->advance();
-//		outFile << '<' + T->tokenType() + "> " + T->identifier() + " </" + T->tokenType() + ">\n";
-		name = T->identifier();
-		table.Define(name, type, k);
+		xml.token(T);
+		table.Define(T->identifierId(), type, k);
 		T->advance();
 	}
-//	outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
-	T->advance();
+	xml.token(T);
+	T->skip(';');
+	xml.close("varDec");
 }
 
-void JackAnalyzer::CompilationEngine::compileStatements() {
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::compileStatements() {
+	xml.open("statements");
 	// check if there are any statements
-	while (T->tokenType() == "keyword") {
-		if (T->keyWord() == "let")
-			compileLet();
-		else if (T->keyWord() == "if")
-			compileIf();
-		else if (T->keyWord() == "while")
-			compileWhile();
-		else if (T->keyWord() == "do")
-			compileDo();
-		else if (T->keyWord() == "return")
-			compileReturn();
+	while (T->tokenType() == KEYWORD) {
+		switch (T->keyWord()) {
+		case K_LET: compileLet(); continue;
+		case K_IF: compileIf(); continue;
+		case K_WHILE: compileWhile(); continue;
+		case K_DO: compileDo(); continue;
+		case K_RETURN: compileReturn(); continue;
+		default: break;
+		}
+		break;	// not a statement
 	}
+	xml.close("statements");
 }
 
-void JackAnalyzer::CompilationEngine::compileLet() {
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::compileLet() {
 	// for symbol table
-	string type, segment;
-	int index;
-//	outFile << '<' + T->tokenType() + "> " + T->keyWord() + " </" + T->tokenType() + ">\n";
+	details var;
+	bool array = false;
+	xml.open("letStatement");
+	xml.token(T);
 	T->advance();
-	// get details about symbol from symbol table?
-	if (table.kindOf(T->identifier()) != NONE) {
-		if (table.kindOf(T->identifier()) == STATIC)
-			segment = "STATIC";
-		else if (table.kindOf(T->identifier()) == FIELD)
-			segment = "THIS";
-		else if (table.kindOf(T->identifier()) == VAR)
-			segment = "LOCAL";
-		else
-			segment = "ARG";
-		type = table.TypeOf(T->identifier());
-		index = table.IndexOf(T->identifier());
-	}
+	if (T->tokenType() != IDENTIFIER)
+		throw runtime_error("expected a variable name but found " + T->found());
+	// get details about symbol from symbol table
+	var = lookupVar(T->identifierId());
 
-//	outFile << '<' + T->tokenType() + "> " + T->identifier() + " </" + T->tokenType() + ">\n";
+	xml.token(T);
 	T->advance();
 	// if variable is an array
-	if (T->tokenType() == "symbol" && T->symbol() == '[') {
-//		outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
+	if (T->tokenType() == SYMBOL && T->symbol() == '[') {
+		array = true;
+		pushVar(var);
+		xml.token(T);
 		T->advance();
 		compileExpression();
-//		outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
-		T->advance();
+		vm.writeArithmetic(OP_ADD);	// target address stays on the stack
+		xml.token(T);
+		T->skip(']');
 	}
-//	outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
-	T->advance();
+	xml.token(T);
+	T->skip('=');
 	compileExpression();
-	cout << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
-//	outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
-	T->advance();
+	if (array)
+		writeArrayStore();
+	else
+		popVar(var);
+	xml.token(T);
+	T->skip(';');
+	xml.close("letStatement");
 }
 
-void JackAnalyzer::CompilationEngine::compileIf() {
-//	outFile << '<' + T->tokenType() + "> " + T->keyWord() + " </" + T->tokenType() + ">\n";
-	T->advance();
-//	outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::compileIf() {
+	string elseLabel = newLabel("IF_FALSE"), endLabel;
+	xml.open("ifStatement");
+	xml.token(T);
 	T->advance();
+	xml.token(T);
+	T->skip('(');
 	compileExpression();
-//	outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
-	T->advance();
-//	outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
-	T->advance();
+	vm.writeArithmetic(OP_NOT);
+	vm.writeIf(elseLabel);
+	xml.token(T);
+	T->skip(')');
+	xml.token(T);
+	T->skip('{');
 	compileStatements();
-//	outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
-	T->advance();
-	if (T->tokenType() == "keyword" && T->keyWord() == "else") {
-//		outFile << '<' + T->tokenType() + "> " + T->keyWord() + " </" + T->tokenType() + ">\n";
-		T->advance();
-//		outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
+	xml.token(T);
+	T->skip('}');
+	if (T->tokenType() == KEYWORD && T->keyWord() == K_ELSE) {
+		endLabel = newLabel("IF_END");
+		vm.writeGoto(endLabel);
+		vm.writeLabel(elseLabel);
+		xml.token(T);
 		T->advance();
+		xml.token(T);
+		T->skip('{');
 		compileStatements();
-//		outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
-		T->advance();
+		xml.token(T);
+		T->skip('}');
+		vm.writeLabel(endLabel);
 	}
+	else
+		vm.writeLabel(elseLabel);
+	xml.close("ifStatement");
 }
 
-void JackAnalyzer::CompilationEngine::compileWhile() {
-//	outFile << '<' + T->tokenType() + "> " + T->keyWord() + " </" + T->tokenType() + ">\n";
-	T->advance();
-//	outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::compileWhile() {
+	string topLabel = newLabel("WHILE_EXP"), endLabel = newLabel("WHILE_END");
+	xml.open("whileStatement");
+	xml.token(T);
 	T->advance();
+	vm.writeLabel(topLabel);
+	xml.token(T);
+	T->skip('(');
 	compileExpression();
-//	outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
-	T->advance();
-//	outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
-	T->advance();
+	vm.writeArithmetic(OP_NOT);
+	vm.writeIf(endLabel);
+	xml.token(T);
+	T->skip(')');
+	xml.token(T);
+	T->skip('{');
 	compileStatements();
-//	outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
-	T->advance();
+	vm.writeGoto(topLabel);
+	vm.writeLabel(endLabel);
+	xml.token(T);
+	T->skip('}');
+	xml.close("whileStatement");
 }
 
-void JackAnalyzer::CompilationEngine::compileDo() {
-//	outFile << '<' + T->tokenType() + "> " + T->keyWord() + " </" + T->tokenType() + ">\n";
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::compileDo() {
+	xml.open("doStatement");
+	xml.token(T);
 	T->advance();
 	compileSubroutineCall();
-	cout << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
-	// outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
-	T->advance();
+	doCall = codeSize() - 1;
+	vm.writePop(SEG_TEMP, 0);	// discard the return value
+	xml.token(T);
+	T->skip(';');
+	xml.close("doStatement");
 }
 
-void JackAnalyzer::CompilationEngine::compileReturn() {
-//	outFile << '<' + T->tokenType() + "> " + T->keyWord() + " </" + T->tokenType() + ">\n";
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::compileReturn() {
+	xml.open("returnStatement");
+	xml.token(T);
 	T->advance();
-	if (T->tokenType() == "symbol" && T->symbol() == ';') {
-//		outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
+	if (T->tokenType() == SYMBOL && T->symbol() == ';') {
+		vm.writePush(SEG_CONST, 0);	// void functions still return a value
+		xml.token(T);
 		T->advance();
 	}
 	else {
+		doCall = 0;	// do f(); return 0; must still return 0
 		compileExpression();
-//		outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
-		T->advance();
+		xml.token(T);
+		T->skip(';');
 	}
-	vm->writeReturn();
-}
-
-void JackAnalyzer::CompilationEngine::compileExpression() {
-	string command;
-	compileTerm();
-	while (T->tokenType() == "symbol" &&
-		(T->symbol() == '+' || T->symbol() == '-' || T->symbol() == '*' || T->symbol() == '/' ||
-		T->symbol() == '&' || T->symbol() == '|' || T->symbol() == '<' || T->symbol() == '>' ||
-		T->symbol() == '=')) {
-		if (T->symbol() == '+')
-			command = "add";
-		else if (T->symbol() == '-')
-			command = "sub";
-		else if (T->symbol() == '*')
-			command = "call Math.multiply 2";
-		else if (T->symbol() == '/')
-			command = "call Math.divide 2";
-		else if (T->symbol() == '&')
-			command = "and";
-		else if (T->symbol() == '|')
-			command = "or";
-		else if (T->symbol() == '<')
-			command = "lt";
-		else if (T->symbol() == '>')
-			command = "gt";
-		else if (T->symbol() == '=')
-			command = "eq";
-
-//		outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
-		T->advance();
-		compileTerm();
-		vm->writeArithmetic(command);
+	writeReturn();
+	xml.close("returnStatement");
+}
+
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::compileExpression() {
+	compileNested(false);
+}
+
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::compileTerm() {
+	compileNested(true);
+}
+
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::compileNested(bool term) {
+	/*
+	*	expression: term (op term)*, evaluated strictly left to right. A term that holds
+	*	more terms or expressions (parentheses, unary ops, array indexes, call arguments)
+	*	pushes a frame onto exprStack and the loop carries on with what is inside it; when
+	*	that is done, the frame on top finishes its part. So nesting depth costs one small
+	*	frame, not C++ stack, and the code and XML come out as the recursive version wrote them.
+	*/
+	size_t base = exprStack.size();
+	bool need = true;	// a term starts at the current token; false: the top frame's inner part just ended
+	details var;
+
+	if (!term) {
+		exprStack.push_back(ExprFrame{ 'e', 0, codeSize(), 0, 0, -1 });
+		xml.open("expression");
+	}
+	for (;;) {
+		if (need) {
+			need = false;
+			xml.open("term");
+			if (T->tokenType() == INT_CONST) {
+				xml.token(T);
+				vm.writePush(SEG_CONST, T->intVal());
+				T->advance();
+			}
+			else if (T->tokenType() == STRING_CONST) {
+				xml.token(T);
+				writeStringConst(T->stringVal());
+				T->advance();
+			}
+			else if (T->tokenType() == KEYWORD && T->keyWord() >= K_TRUE && T->keyWord() <= K_THIS) {	// true, false, null, this
+				writeKeywordConst(T->keyWord());
+				xml.token(T);
+				T->advance();
+			}
+			else if (T->tokenType() == IDENTIFIER) {
+				// look one token ahead: subroutineName( or className/varName. starts a call
+				if (T->peekSymbol() == '(' || T->peekSymbol() == '.') {
+					int nArgs;
+					int name = compileCallName(nArgs);
+					xml.open("expressionList");
+					if (T->tokenType() == SYMBOL && T->symbol() == ')') {
+						xml.close("expressionList");
+						finishCall(name, nArgs);
+					}
+					else {
+						exprStack.push_back(ExprFrame{ 'c', 0, 0, 0, nArgs, name });
+						exprStack.push_back(ExprFrame{ 'e', 0, codeSize(), 0, 0, -1 });
+						xml.open("expression");
+						need = true;
+						continue;
+					}
+				}
+				else {
+					var = lookupVar(T->identifierId());
+					pushVar(var);
+					xml.token(T);
+					T->advance();
+					if (T->tokenType() == SYMBOL && T->symbol() == '[') {
+						xml.token(T);
+						T->advance();
+						exprStack.push_back(ExprFrame{ '[', 0, 0, 0, 0, -1 });
+						exprStack.push_back(ExprFrame{ 'e', 0, codeSize(), 0, 0, -1 });
+						xml.open("expression");
+						need = true;
+						continue;
+					}
+				}
+			}
+			else if (T->tokenType() == SYMBOL && T->symbol() == '(') {
+				xml.token(T);
+				T->advance();
+				exprStack.push_back(ExprFrame{ '(', 0, 0, 0, 0, -1 });
+				exprStack.push_back(ExprFrame{ 'e', 0, codeSize(), 0, 0, -1 });
+				xml.open("expression");
+				need = true;
+				continue;
+			}
+			else if (T->tokenType() == SYMBOL && (T->symbol() == '-' || T->symbol() == '~')) {
+				exprStack.push_back(ExprFrame{ T->symbol(), 0, codeSize(), 0, 0, -1 });
+				xml.token(T);
+				T->advance();
+				need = true;
+				continue;
+			}
+			else
+				throw runtime_error("expected a term but found " + T->found());
+			xml.close("term");
+		}
+		// a term (for 'e' and unary frames) or an expression (for the rest) just ended
+		if (exprStack.size() == base)
+			return;
+		ExprFrame& f = exprStack.back();
+		switch (f.kind) {
+		case 'e':
+			if (f.op)
+				writeBinary(f.op, f.left, f.right);
+			if (T->tokenType() == SYMBOL && isOp(T->symbol())) {
+				f.op = T->symbol();
+				xml.token(T);
+				T->advance();
+				f.right = codeSize();
+				need = true;
+				continue;
+			}
+			xml.close("expression");
+			exprStack.pop_back();
+			continue;	// the expression ends a part of the frame below
+		case '-':
+		case '~':
+			writeUnary(f.kind == '-' ? OP_NEG : OP_NOT, f.left);
+			break;
+		case '(':
+			xml.token(T);
+			T->skip(')');
+			break;
+		case '[':
+			vm.writeArithmetic(OP_ADD);
+			vm.writePop(SEG_POINTER, 1);
+			vm.writePush(SEG_THAT, 0);
+			xml.token(T);
+			T->skip(']');
+			break;
+		case 'c':
+			f.nArgs++;
+			if (T->tokenType() == SYMBOL && T->symbol() == ',') {
+				xml.token(T);
+				T->advance();
+				exprStack.push_back(ExprFrame{ 'e', 0, codeSize(), 0, 0, -1 });
+				xml.open("expression");
+				need = true;
+				continue;
+			}
+			xml.close("expressionList");
+			finishCall(f.name, f.nArgs);
+			break;
+		}
+		exprStack.pop_back();
+		xml.close("term");
 	}
 }
 
-void JackAnalyzer::CompilationEngine::compileTerm() {
-	string segment, type;
-	int index;
-	if (T->tokenType() == "int_const") {
-//		outFile << '<' + T->tokenType() + "> " + to_string(T->intVal()) + " </" + T->tokenType() + ">\n";
-		vm->writePush("constant", T->intVal());
-		T->advance();
+template <class Output>
+int JackAnalyzer::CompilationEngine<Output>::compileExpressionList() {
+	int n = 0;
+	xml.open("expressionList");
+	if (!(T->tokenType() == SYMBOL && T->symbol() == ')')) {
+		compileExpression();
+		n++;
+		while (T->tokenType() == SYMBOL && T->symbol() == ',') {
+			xml.token(T);
+			T->advance();
+			compileExpression();
+			n++;
+		}
 	}
-	else if (T->tokenType() == "string_const") {
-//		outFile << '<' + T->tokenType() + "> " + T->stringVal() + " </" + T->tokenType() + ">\n";
-		// push string length
-		vm->writePush("constant", T->stringVal().length());
-		// call String constructor
-		vm->writeCall("String.new", 1);
-		// append all characters to new string
-		for (int i = 0; i < T->stringVal().length(); i++) {
-			vm->writePush("constant", (int)T->stringVal()[i]);
-			vm->writeCall("String.appendChar", 1);
+	xml.close("expressionList");
+	return n;
+}
+
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::compileSubroutineCall() {
+	int nArgs;
+	int name = compileCallName(nArgs);
+	nArgs += compileExpressionList();
+	finishCall(name, nArgs);
+}
+
+template <class Output>
+int JackAnalyzer::CompilationEngine<Output>::compileCallName(int& nArgs) {
+	string subroutineName(T->identifier());
+	details var = table.lookup(T->identifierId());
+	nArgs = 0;
+	xml.token(T);
+	T->advance();
+	if (T->symbol() == '(') {	// method of this class, called on this
+		subroutineName = className + '.' + subroutineName;
+		vm.writePush(SEG_POINTER, 0);
+		nArgs = 1;
+	}
+	else {
+		if (var.kind != NONE) {	// varName.method(): call on the object, through its class
+			pushVar(var);
+			subroutineName = string(T->name(var.type));
+			nArgs = 1;
 		}
+		subroutineName += '.';
+		xml.token(T);
+		T->skip('.');
+		subroutineName += T->identifier();
+		xml.token(T);
 		T->advance();
 	}
-	else if (T->tokenType() == "keyword") {	// true, false, null, this
-		if (T->keyWord() == "true") {
-			vm->writePush("constant", 1);
-			vm->writeArithmetic("neg");
+	xml.token(T);
+	T->skip('(');
+	if constexpr (Output::vm)
+		return vm.code.name(subroutineName);
+	else
+		return -1;	// no code, so no names either
+}
+
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::finishCall(int name, int nArgs) {
+	xml.token(T);
+	T->skip(')');
+	if constexpr (Output::vm)
+		vm.writeCall(vm.code.nameOf(name), nArgs);
+}
+
+template <class Output>
+size_t JackAnalyzer::CompilationEngine<Output>::codeSize() {
+	if constexpr (Output::vm)
+		return vm.code.code.size();
+	else
+		return 0;
+}
+
+template <class Output>
+JackAnalyzer::details JackAnalyzer::CompilationEngine<Output>::lookupVar(int name) {
+	details var = table.lookup(name);
+	if constexpr (Output::vm) {	// the syntax analyzer's test files use names they never declare
+		if (var.kind == NONE)
+			throw runtime_error("undeclared variable " + string(T->name(name)));
+	}
+	return var;
+}
+
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::pushVar(details var) {
+	if (var.kind == STATIC)
+		vm.writePush(SEG_STATIC, var.index);
+	else if (var.kind == FIELD)
+		vm.writePush(SEG_THIS, var.index);
+	else if (var.kind == VAR)
+		vm.writePush(SEG_LOCAL, var.index);
+	else if (var.kind == ARG)
+		vm.writePush(SEG_ARG, var.index);
+}
+
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::popVar(details var) {
+	if (var.kind == STATIC)
+		vm.writePop(SEG_STATIC, var.index);
+	else if (var.kind == FIELD)
+		vm.writePop(SEG_THIS, var.index);
+	else if (var.kind == VAR)
+		vm.writePop(SEG_LOCAL, var.index);
+	else if (var.kind == ARG)
+		vm.writePop(SEG_ARG, var.index);
+}
+
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::writeArrayStore() {
+	// value goes through temp 0 so the right side may itself use that
+	vm.writePop(SEG_TEMP, 0);
+	vm.writePop(SEG_POINTER, 1);
+	vm.writePush(SEG_TEMP, 0);
+	vm.writePop(SEG_THAT, 0);
+}
+
+template <class Output>
+size_t JackAnalyzer::CompilationEngine<Output>::writePrologue(KEYWORDTYPE kind, const string& functionName) {
+	size_t start;
+	vm.writeFunction(functionName, table.VarCount(VAR));
+	start = codeSize();
+	subName = functionName;
+	subKind = kind;
+	bodyStart = start;
+	topLabel.clear();
+	doCall = 0;
+	if (kind == K_CONSTRUCTOR) {	// allocate the object and anchor this to it
+		vm.writePush(SEG_CONST, table.VarCount(FIELD));
+		vm.writeCall("Memory.alloc", 1);
+		vm.writePop(SEG_POINTER, 0);
+	}
+	else if (kind == K_METHOD) {	// this = argument 0
+		vm.writePush(SEG_ARG, 0);
+		vm.writePop(SEG_POINTER, 0);
+	}
+	return start;
+}
+
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::writeReturn() {
+	/*
+	*	return f(...) and do f(...); return; where f is the subroutine being compiled:
+	*	the new arguments are already on the stack, so pop them over the old ones, zero
+	*	the locals again and jump back above the prologue (which re-reads this for a
+	*	method) instead of stacking another frame. Constructors would allocate again.
+	*/
+	if constexpr (Output::vm) {
+		vector<VMInstr>& code = vm.code.code;
+		size_t n = code.size(), call;
+		int nArgs = table.VarCount(ARG);
+
+		if (!opt.tailCalls || subKind == K_CONSTRUCTOR) {
+			vm.writeReturn();
+			return;
 		}
-		else if (T->keyWord() == "false" || T->keyWord() == "null")
-			vm->writePush("constant", 0);
+		if (doCall && doCall + 3 == n)
+			call = doCall;	// do f(...); return;
 		else
-			vm->writePush("argument", 0); // not sure about dealing w/ the this keyword?
-//		outFile << '<' + T->tokenType() + "> " + T->keyWord() + " </" + T->tokenType() + ">\n";
-		T->advance();
+			call = n - 1;
+		doCall = 0;
+		if (call < bodyStart || call >= n || code[call].op != OP_CALL || code[call].arg != nArgs || vm.code.nameOf(code[call].name) != subName) {
+			vm.writeReturn();
+			return;
+		}
+		code.resize(call);
+		if (topLabel.empty()) {	// the label goes in under the function line, where the pool guard will also go
+			topLabel = newLabel("TAIL_TOP");
+			code.insert(code.begin() + bodyStart, VMInstr{ OP_LABEL, SEG_NONE, 0, vm.code.name(topLabel) });
+		}
+		for (int i = nArgs - 1; i >= 0; i--)
+			vm.writePop(SEG_ARG, i);
+		for (int i = 0; i < table.VarCount(VAR); i++) {
+			vm.writePush(SEG_CONST, 0);
+			vm.writePop(SEG_LOCAL, i);
+		}
+		vm.writeGoto(topLabel);
 	}
-	else if (T->tokenType() == "identifier") {
-		// get details about symbol from symbol table?
-		if (table.kindOf(T->identifier()) != NONE) {
-			if (table.kindOf(T->identifier()) == STATIC)
-				segment = "static";
-			else if (table.kindOf(T->identifier()) == FIELD)
-				segment = "this";
-			else if (table.kindOf(T->identifier()) == VAR)
-				segment = "local";
+}
+
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::writePoolGuard(size_t start) {
+	if constexpr (Output::vm) {
+		string ready;
+		if (!usesPool)
+			return;
+		// build the pool on first use: if (~guard) { do className.$init(); }
+		vector<VMInstr>& code = vm.code.code;
+		size_t end = code.size();
+		ready = newLabel("POOL_READY");
+		vm.writePush(SEG_STATIC, poolBase - 1);
+		vm.writeIf(ready);
+		vm.writeCall(className + ".$init", 0);
+		vm.writePop(SEG_TEMP, 0);
+		vm.writeLabel(ready);
+		rotate(code.begin() + start, code.begin() + end, code.end());	// move it up under the function line
+	}
+}
+
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::writeBinary(char op, size_t left, size_t right) {
+	if (opt.fold && foldBinary(op, left, right))
+		return;
+	switch (op) {
+	case '*':
+	case '/':
+		if (!(opt.reduce && reduceMulDiv(op, left, right)))
+			vm.writeCall(op == '*' ? "Math.multiply" : "Math.divide", 2);
+		break;
+	case '+': vm.writeArithmetic(OP_ADD); break;
+	case '-': vm.writeArithmetic(OP_SUB); break;
+	case '&': vm.writeArithmetic(OP_AND); break;
+	case '|': vm.writeArithmetic(OP_OR); break;
+	case '<': vm.writeArithmetic(OP_LT); break;
+	case '>': vm.writeArithmetic(OP_GT); break;
+	case '=': vm.writeArithmetic(OP_EQ); break;
+	}
+}
+
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::writeUnary(VMOP op, size_t from) {
+	if (!(opt.fold && foldUnary(op, from)))
+		vm.writeArithmetic(op);
+}
+
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::writeKeywordConst(KEYWORDTYPE k) {
+	if (k == K_TRUE) {
+		vm.writePush(SEG_CONST, 1);
+		vm.writeArithmetic(OP_NEG);
+	}
+	else if (k == K_FALSE || k == K_NULL)
+		vm.writePush(SEG_CONST, 0);
+	else
+		vm.writePush(SEG_POINTER, 0);	// this
+}
+
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::writeStringConst(string_view s) {
+	if (opt.pool) {	// one shared String per distinct literal
+		auto slot = literals.emplace(string(s), poolBase + (int)poolOrder.size());
+		if (slot.second)
+			poolOrder.push_back(slot.first->first);
+		vm.writePush(SEG_STATIC, slot.first->second);
+		usesPool = true;
+	}
+	else
+		writeString(s);
+}
+
+template <class Output>
+string JackAnalyzer::CompilationEngine<Output>::newLabel(const char* prefix) {
+	return prefix + to_string(labelCount++);
+}
+
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::writeString(string_view s) {
+	// push string length
+	vm.writePush(SEG_CONST, (int)s.length());
+	// call String constructor
+	vm.writeCall("String.new", 1);
+	// append all characters to new string
+	for (char c : s) {
+		vm.writePush(SEG_CONST, (unsigned char)c);
+		vm.writeCall("String.appendChar", 2);
+	}
+}
+
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::writePoolInit() {
+	// '$' cannot appear in a Jack identifier, so this never clashes with a user subroutine
+	vm.writeFunction(className + ".$init", 0);
+	for (size_t i = 0; i < poolOrder.size(); i++) {
+		writeString(poolOrder[i]);
+		vm.writePop(SEG_STATIC, poolBase + (int)i);
+	}
+	vm.writePush(SEG_CONST, 1);
+	vm.writeArithmetic(OP_NEG);
+	vm.writePop(SEG_STATIC, poolBase - 1);
+	vm.writePush(SEG_CONST, 0);
+	vm.writeReturn();
+}
+
+template <class Output>
+bool JackAnalyzer::CompilationEngine<Output>::foldBinary(char op, size_t left, size_t right) {
+	if constexpr (Output::vm) {
+		int a, b, v;
+		VMCode& code = vm.code;
+
+		if (!code.isConstant(left, right, a) || !code.isConstant(right, code.code.size(), b))
+			return false;
+		switch (op) {
+		case '+': v = a + b; break;
+		case '-': v = a - b; break;
+		case '*': v = a * b; break;
+		case '/':
+			if (b == 0)
+				return false;	// leave it to Math.divide to report at run time
+			v = a / b;	// truncates toward zero, like Math.divide
+			break;
+		case '&': v = a & b; break;
+		case '|': v = a | b; break;
+		case '<': v = a < b ? -1 : 0; break;
+		case '>': v = a > b ? -1 : 0; break;
+		case '=': v = a == b ? -1 : 0; break;
+		default: return false;
+		}
+		code.code.resize(left);
+		code.emitConstant((short)v);	// wrap like the 16-bit platform does
+		return true;
+	}
+	return false;
+}
+
+template <class Output>
+bool JackAnalyzer::CompilationEngine<Output>::reduceMulDiv(char op, size_t left, size_t right) {
+	if constexpr (Output::vm) {
+		int c, ones = 0;
+		bool onRight;
+		VMCode& code = vm.code;
+
+		if (code.isConstant(right, code.code.size(), c))
+			onRight = true;
+		else if (op == '*' && code.isConstant(left, right, c))
+			onRight = false;
+		else
+			return false;
+		if (op == '/' && (!onRight || (c != 1 && c != -1)))
+			return false;	// no shifts in the VM, and dividing negatives must round toward zero
+		for (unsigned u = (unsigned short)(c < 0 ? -c : c); u; u &= u - 1)
+			ones++;
+		if (ones > 4)
+			return false;	// the add chain would outgrow the call
+
+		if (onRight)
+			code.code.resize(right);
+		else	// a constant has no side effects to keep
+			code.code.erase(code.code.begin() + left, code.code.begin() + right);
+		writeMultiply(c);	// x / 1 and x / -1 are x * 1 and x * -1
+		return true;
+	}
+	return false;
+}
+
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::writeMultiply(int c) {
+	bool negative = c < 0;
+	unsigned u = (unsigned short)(negative ? -c : c), bit = 0x8000;
+
+	if (u == 0) {	// the operand still runs for its side effects
+		vm.writePop(SEG_TEMP, 0);
+		vm.writePush(SEG_CONST, 0);
+		return;
+	}
+	while (!(u & bit))
+		bit >>= 1;
+	if (u != bit) {	// keep x in temp 1, the running product stays on the stack
+		vm.writePop(SEG_TEMP, 1);
+		vm.writePush(SEG_TEMP, 1);
+	}
+	// binary method from the top bit down: double, then add x for each set bit
+	for (bit >>= 1; bit; bit >>= 1) {
+		vm.writePop(SEG_TEMP, 2);
+		vm.writePush(SEG_TEMP, 2);
+		vm.writePush(SEG_TEMP, 2);
+		vm.writeArithmetic(OP_ADD);
+		if (u & bit) {
+			vm.writePush(SEG_TEMP, 1);
+			vm.writeArithmetic(OP_ADD);
+		}
+	}
+	if (negative)
+		vm.writeArithmetic(OP_NEG);
+}
+
+template <class Output>
+bool JackAnalyzer::CompilationEngine<Output>::foldUnary(VMOP op, size_t from) {
+	if constexpr (Output::vm) {
+		int a;
+		VMCode& code = vm.code;
+
+		if (!code.isConstant(from, code.code.size(), a))
+			return false;
+		code.code.resize(from);
+		code.emitConstant((short)(op == OP_NEG ? -a : ~a));
+		return true;
+	}
+	return false;
+}
+
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::writeType() {
+	// int, char, boolean or a class name
+	xml.token(T);
+	T->advance();
+}
+
+/*
+*	AST path: the tree holds the class exactly as the Compile* functions read it, so
+*	generating from it gives the same instructions, labels and pool slots in the same order.
+*/
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::genClass(AstClass* c) {
+	className = string(T->name(c->name));
+	for (AstVar* v = c->vars; v; v = v->next)
+		table.Define(v->name, v->type, (KIND)v->kind);
+	// pooled literals go after the declared statics
+	literals.clear();
+	poolOrder.clear();
+	poolBase = table.VarCount(STATIC) + 1;
+	for (AstSub* s = c->subs; s; s = s->next)
+		genSubroutine(c, s);
+	if (!poolOrder.empty())
+		writePoolInit();
+}
+
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::genSubroutine(AstClass* c, AstSub* s) {
+	KEYWORDTYPE kind = (KEYWORDTYPE)s->kind;
+	size_t start;
+	table.startSubroutine();
+	labelCount = 0;
+	usesPool = false;
+	if (kind == K_METHOD)
+		table.Define(c->thisName, c->name, ARG);
+	for (AstVar* v = s->params; v; v = v->next)
+		table.Define(v->name, v->type, ARG);
+	for (AstVar* v = s->locals; v; v = v->next)
+		table.Define(v->name, v->type, VAR);
+	start = writePrologue(kind, className + '.' + string(T->name(s->name)));
+	genStatements(s->body);
+	writePoolGuard(start);
+}
+
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::genStatements(AstStmt* s) {
+	details var;
+	string topLabel, elseLabel, endLabel;
+	for (; s; s = s->next) {
+		switch (s->kind) {
+		case AS_LET:
+			var = lookupVar(s->var);
+			if (s->index) {
+				pushVar(var);
+				genExpression(s->index);
+				vm.writeArithmetic(OP_ADD);	// target address stays on the stack
+				genExpression(s->expr);
+				writeArrayStore();
+			}
+			else {
+				genExpression(s->expr);
+				popVar(var);
+			}
+			break;
+		case AS_IF:
+			elseLabel = newLabel("IF_FALSE");
+			genExpression(s->expr);
+			vm.writeArithmetic(OP_NOT);
+			vm.writeIf(elseLabel);
+			genStatements(s->body);
+			if (s->hasElse) {
+				endLabel = newLabel("IF_END");	// numbered after the then branch, as compileIf does
+				vm.writeGoto(endLabel);
+				vm.writeLabel(elseLabel);
+				genStatements(s->orelse);
+				vm.writeLabel(endLabel);
+			}
+			else
+				vm.writeLabel(elseLabel);
+			break;
+		case AS_WHILE:
+			topLabel = newLabel("WHILE_EXP");
+			endLabel = newLabel("WHILE_END");
+			vm.writeLabel(topLabel);
+			genExpression(s->expr);
+			vm.writeArithmetic(OP_NOT);
+			vm.writeIf(endLabel);
+			genStatements(s->body);
+			vm.writeGoto(topLabel);
+			vm.writeLabel(endLabel);
+			break;
+		case AS_DO:
+			genExpression(s->expr);
+			doCall = codeSize() - 1;
+			vm.writePop(SEG_TEMP, 0);	// discard the return value
+			break;
+		case AS_RETURN:
+			if (s->expr) {
+				doCall = 0;	// do f(); return 0; must still return 0
+				genExpression(s->expr);
+			}
 			else
-				segment = "argument";
-			type = table.TypeOf(T->identifier());
-			index = table.IndexOf(T->identifier());
-			vm->writePush(segment, index);
+				vm.writePush(SEG_CONST, 0);	// void functions still return a value
+			writeReturn();
+			break;
 		}
-//		outFile << '<' + T->tokenType() + "> " + T->identifier() + " </" + T->tokenType() + ">\n";
+	}
+}
+
+template <class Output>
+void JackAnalyzer::CompilationEngine<Output>::genExpression(AstExpr* e) {
+	/*
+	*	post-order walk on genStack: a node writes what goes before its operands when it is
+	*	reached and the rest once its last operand is written, as compileNested does while parsing
+	*/
+	size_t base = genStack.size();
+	string subroutineName;
+	details var;
+	int nArgs, name = -1;
+
+	for (;;) {
+		switch (e->kind) {
+		case AE_INT: vm.writePush(SEG_CONST, e->value); break;
+		case AE_STRING: writeStringConst(T->tokenText(e->value)); break;
+		case AE_TRUE: writeKeywordConst(K_TRUE); break;
+		case AE_FALSE: writeKeywordConst(K_FALSE); break;
+		case AE_NULL: writeKeywordConst(K_NULL); break;
+		case AE_THIS: writeKeywordConst(K_THIS); break;
+		case AE_VAR: pushVar(lookupVar(e->value)); break;
+		case AE_INDEX:
+			pushVar(lookupVar(e->value));
+			genStack.push_back(GenFrame{ e, e->left, codeSize(), 0, 0, -1 });
+			break;
+		case AE_CALL:
+			nArgs = 0;
+			if (e->recv < 0) {	// method of this class, called on this
+				subroutineName = className;
+				vm.writePush(SEG_POINTER, 0);
+				nArgs = 1;
+			}
+			else {
+				var = table.lookup(e->recv);
+				if (var.kind != NONE) {	// varName.method(): call on the object, through its class
+					pushVar(var);
+					subroutineName = string(T->name(var.type));
+					nArgs = 1;
+				}
+				else
+					subroutineName = string(T->name(e->recv));
+			}
+			subroutineName += '.';
+			subroutineName += T->name(e->value);
+			if constexpr (Output::vm)
+				name = vm.code.name(subroutineName);
+			genStack.push_back(GenFrame{ e, e->left, 0, 0, nArgs, name });
+			break;
+		case AE_UNARY:
+		case AE_BINARY:
+			genStack.push_back(GenFrame{ e, e->left, codeSize(), 0, 0, -1 });
+			break;
+		}
+		// the next operand to write, finishing every node that has none left
+		e = nullptr;
+		while (!e && genStack.size() > base) {
+			GenFrame& f = genStack.back();
+			if (f.next) {
+				e = f.next;
+				if (f.e->kind == AE_CALL) {
+					f.nArgs++;
+					f.next = e->next;
+				}
+				else if (e == f.e->left && f.e->kind == AE_BINARY)
+					f.next = f.e->right;
+				else {
+					if (f.e->kind == AE_BINARY)
+						f.right = codeSize();
+					f.next = nullptr;
+				}
+				continue;
+			}
+			switch (f.e->kind) {
+			case AE_INDEX:
+				vm.writeArithmetic(OP_ADD);
+				vm.writePop(SEG_POINTER, 1);
+				vm.writePush(SEG_THAT, 0);
+				break;
+			case AE_CALL:
+				if constexpr (Output::vm)
+					vm.writeCall(vm.code.nameOf(f.name), f.nArgs);
+				break;
+			case AE_UNARY: writeUnary(f.e->op == '-' ? OP_NEG : OP_NOT, f.left); break;
+			case AE_BINARY: writeBinary(f.e->op, f.left, f.right); break;
+			}
+			genStack.pop_back();
+		}
+		if (!e)
+			return;
+	}
+}
+
+template class JackAnalyzer::CompilationEngine<JackAnalyzer::VMOnly>;
+template class JackAnalyzer::CompilationEngine<JackAnalyzer::XMLOnly>;
+template class JackAnalyzer::CompilationEngine<JackAnalyzer::VMAndXML>;
+
+/*AST PARSER FUNCTIONS*/
+// walks the same grammar as the CompilationEngine, but only builds nodes: no symbols, no code
+JackAnalyzer::ASTParser::ASTParser(JackTokenizer* T, Arena* arena) {
+	this->T = T;
+	this->arena = arena;
+}
+
+AstExpr* JackAnalyzer::ASTParser::node(ASTEXPR kind) {
+	AstExpr* e = arena->make<AstExpr>();
+	e->kind = (unsigned char)kind;
+	e->recv = -1;
+	return e;
+}
+
+AstStmt* JackAnalyzer::ASTParser::node(ASTSTMT kind) {
+	AstStmt* s = arena->make<AstStmt>();
+	s->kind = (unsigned char)kind;
+	return s;
+}
+
+AstClass* JackAnalyzer::ASTParser::parseClass() {
+	AstClass* c = arena->make<AstClass>();
+	AstVar** vars = &c->vars;
+	AstSub** subs = &c->subs;
+	T->advance();	// class
+	c->name = T->identifierId();
+	c->thisName = T->intern("this");
+	T->advance();
+	T->skip('{');
+	while (T->tokenType() == KEYWORD && (T->keyWord() == K_STATIC || T->keyWord() == K_FIELD))
+		vars = declare(vars, T->keyWord() == K_STATIC ? STATIC : FIELD);
+	while (T->tokenType() == KEYWORD &&
+		(T->keyWord() == K_CONSTRUCTOR || T->keyWord() == K_FUNCTION || T->keyWord() == K_METHOD)) {
+		*subs = parseSubroutine();
+		subs = &(*subs)->next;
+	}
+	T->skip('}');
+	return c;
+}
+
+AstVar** JackAnalyzer::ASTParser::declare(AstVar** tail, KIND kind) {
+	int type;
+	T->advance();	// static, field or var
+	type = T->intern(T->tokenText());
+	T->advance();
+	for (;;) {
+		AstVar* v = arena->make<AstVar>();
+		v->kind = (unsigned char)kind;
+		v->name = T->identifierId();
+		v->type = type;
+		*tail = v;
+		tail = &v->next;
+		T->advance();
+		if (!(T->tokenType() == SYMBOL && T->symbol() == ','))
+			break;
 		T->advance();
-		if (T->tokenType() == "symbol" && T->symbol() == '[') {
-//			outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
+	}
+	T->skip(';');
+	return tail;
+}
+
+AstSub* JackAnalyzer::ASTParser::parseSubroutine() {
+	AstSub* s = arena->make<AstSub>();
+	AstVar** tail = &s->params;
+	s->kind = (unsigned char)T->keyWord();
+	T->advance();
+	s->type = T->intern(T->tokenText());
+	T->advance();
+	s->name = T->identifierId();
+	T->advance();
+	T->skip('(');
+	// parameter list; types may be class names, so anything but ) starts one
+	if (!(T->tokenType() == SYMBOL && T->symbol() == ')')) {
+		for (;;) {
+			AstVar* v = arena->make<AstVar>();
+			v->kind = ARG;
+			v->type = T->intern(T->tokenText());
 			T->advance();
-			compileExpression();
-//			outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
+			v->name = T->identifierId();
+			T->advance();
+			*tail = v;
+			tail = &v->next;
+			if (!(T->tokenType() == SYMBOL && T->symbol() == ','))
+				break;
 			T->advance();
 		}
-		else if (T->tokenType() == "symbol" && T->symbol() == '(') {
-			compileSubroutineCall();
+	}
+	T->skip(')');
+	T->skip('{');
+	tail = &s->locals;
+	while (T->tokenType() == KEYWORD && T->keyWord() == K_VAR)
+		tail = declare(tail, VAR);
+	s->body = parseStatements();
+	T->skip('}');
+	return s;
+}
+
+AstStmt* JackAnalyzer::ASTParser::parseStatements() {
+	AstStmt* first = nullptr;
+	AstStmt** tail = &first;
+	while (T->tokenType() == KEYWORD) {
+		switch (T->keyWord()) {
+		case K_LET: *tail = parseLet(); break;
+		case K_IF: *tail = parseIf(); break;
+		case K_WHILE: *tail = parseWhile(); break;
+		case K_DO: *tail = parseDo(); break;
+		case K_RETURN: *tail = parseReturn(); break;
+		default: return first;	// not a statement
 		}
+		tail = &(*tail)->next;
+	}
+	return first;
+}
+
+AstStmt* JackAnalyzer::ASTParser::parseLet() {
+	AstStmt* s = node(AS_LET);
+	T->advance();	// let
+	if (T->tokenType() != IDENTIFIER)
+		throw runtime_error("expected a variable name but found " + T->found());
+	s->var = T->identifierId();
+	T->advance();
+	if (T->tokenType() == SYMBOL && T->symbol() == '[') {
+		T->advance();
+		s->index = parseExpression();
+		T->skip(']');
+	}
+	T->skip('=');
+	s->expr = parseExpression();
+	T->skip(';');
+	return s;
+}
+
+AstStmt* JackAnalyzer::ASTParser::parseIf() {
+	AstStmt* s = node(AS_IF);
+	T->advance();	// if
+	T->skip('(');
+	s->expr = parseExpression();
+	T->skip(')');
+	T->skip('{');
+	s->body = parseStatements();
+	T->skip('}');
+	if (T->tokenType() == KEYWORD && T->keyWord() == K_ELSE) {
+		s->hasElse = true;
+		T->advance();	// else
+		T->skip('{');
+		s->orelse = parseStatements();
+		T->skip('}');
 	}
-	else if (T->tokenType() == "symbol") {
-		if (T->symbol() == '(') {
-//			outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
+	return s;
+}
+
+AstStmt* JackAnalyzer::ASTParser::parseWhile() {
+	AstStmt* s = node(AS_WHILE);
+	T->advance();	// while
+	T->skip('(');
+	s->expr = parseExpression();
+	T->skip(')');
+	T->skip('{');
+	s->body = parseStatements();
+	T->skip('}');
+	return s;
+}
+
+AstStmt* JackAnalyzer::ASTParser::parseDo() {
+	AstStmt* s = node(AS_DO);
+	T->advance();	// do
+	s->expr = parseCall();
+	T->skip(';');
+	return s;
+}
+
+AstStmt* JackAnalyzer::ASTParser::parseReturn() {
+	AstStmt* s = node(AS_RETURN);
+	T->advance();	// return
+	if (!(T->tokenType() == SYMBOL && T->symbol() == ';'))
+		s->expr = parseExpression();
+	T->skip(';');
+	return s;
+}
+
+AstExpr* JackAnalyzer::ASTParser::parseExpression() {
+	/*
+	*	term (op term)*, left to right, without precedence. A term that holds more terms or
+	*	expressions pushes a frame and the loop reads what is inside it; when that ends, the
+	*	frame on top takes the result. So deep nesting costs frames, not C++ stack.
+	*/
+	size_t base = frames.size();
+	AstExpr* t;	// the term just read
+
+	frames.push_back(Frame{ 'e', nullptr, nullptr, nullptr });
+	for (;;) {
+		if (T->tokenType() == INT_CONST) {
+			t = node(AE_INT);
+			t->value = T->intVal();
 			T->advance();
-			compileExpression();
-//			outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
+		}
+		else if (T->tokenType() == STRING_CONST) {
+			t = node(AE_STRING);
+			t->value = T->position();
+			T->advance();
+		}
+		else if (T->tokenType() == KEYWORD && T->keyWord() >= K_TRUE && T->keyWord() <= K_THIS) {	// true, false, null, this
+			switch (T->keyWord()) {
+			case K_TRUE: t = node(AE_TRUE); break;
+			case K_FALSE: t = node(AE_FALSE); break;
+			case K_NULL: t = node(AE_NULL); break;
+			default: t = node(AE_THIS); break;
+			}
+			T->advance();
+		}
+		else if (T->tokenType() == IDENTIFIER && (T->peekSymbol() == '(' || T->peekSymbol() == '.')) {
+			// look one token ahead: subroutineName( or className/varName. starts a call
+			t = parseCallName();
+			if (!(T->tokenType() == SYMBOL && T->symbol() == ')')) {
+				frames.push_back(Frame{ 'c', t, nullptr, &t->left });
+				frames.push_back(Frame{ 'e', nullptr, nullptr, nullptr });
+				continue;
+			}
+			T->advance();	// )
+		}
+		else if (T->tokenType() == IDENTIFIER) {
+			t = node(AE_VAR);
+			t->value = T->identifierId();
+			T->advance();
+			if (T->tokenType() == SYMBOL && T->symbol() == '[') {
+				t->kind = AE_INDEX;
+				T->advance();
+				frames.push_back(Frame{ '[', t, nullptr, nullptr });
+				frames.push_back(Frame{ 'e', nullptr, nullptr, nullptr });
+				continue;
+			}
+		}
+		else if (T->tokenType() == SYMBOL && T->symbol() == '(') {	// grouping only; the inner expression is the term
 			T->advance();
+			frames.push_back(Frame{ '(', nullptr, nullptr, nullptr });
+			frames.push_back(Frame{ 'e', nullptr, nullptr, nullptr });
+			continue;
 		}
-		else if (T->symbol() == '-' || T->symbol() == '~') {
-//			outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
+		else if (T->tokenType() == SYMBOL && (T->symbol() == '-' || T->symbol() == '~')) {
+			t = node(AE_UNARY);
+			t->op = T->symbol();
 			T->advance();
-			compileTerm();
+			frames.push_back(Frame{ 'u', t, nullptr, nullptr });
+			continue;
+		}
+		else
+			throw runtime_error("expected a term but found " + T->found());
+
+		// t is complete: hand it up until a frame wants another term
+		for (;;) {
+			Frame& f = frames.back();
+			if (f.kind == 'u') {
+				f.e->left = t;
+				t = f.e;
+				frames.pop_back();
+				continue;
+			}
+			if (f.open)
+				f.open->right = t;
+			else
+				f.e = t;
+			if (T->tokenType() == SYMBOL && isOp(T->symbol())) {
+				f.open = node(AE_BINARY);
+				f.open->op = T->symbol();
+				f.open->left = f.e;
+				f.e = f.open;
+				T->advance();
+				break;
+			}
+			t = f.e;	// the expression ends a part of the frame below
+			frames.pop_back();
+			if (frames.size() == base)
+				return t;
+			Frame& g = frames.back();
+			if (g.kind == '(')
+				T->skip(')');
+			else if (g.kind == '[') {
+				g.e->left = t;
+				T->skip(']');
+				t = g.e;
+			}
+			else {	// 'c'
+				*g.tail = t;
+				g.tail = &t->next;
+				if (T->tokenType() == SYMBOL && T->symbol() == ',') {
+					T->advance();
+					frames.push_back(Frame{ 'e', nullptr, nullptr, nullptr });
+					break;
+				}
+				T->skip(')');
+				t = g.e;
+			}
+			frames.pop_back();
 		}
 	}
 }
 
-void JackAnalyzer::CompilationEngine::compileExpressionList() {
-	if (T->tokenType() == "symbol" && T->symbol() == ')')
-		return;
-	compileExpression();
-	argCount++;
+AstExpr* JackAnalyzer::ASTParser::parseCallName() {
+	AstExpr* e = node(AE_CALL);
+	e->value = T->identifierId();
 	T->advance();
-	while (T->tokenType() == "symbol" && T->symbol() == ',') {
-//		outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
+	if (T->symbol() != '(') {	// className/varName.subroutineName
+		e->recv = e->value;
+		T->skip('.');
+		e->value = T->identifierId();
 		T->advance();
-		compileExpression();
-		argCount++;
 	}
+	T->skip('(');
+	return e;
 }
 
-void JackAnalyzer::CompilationEngine::compileSubroutineCall() {
-	string subroutineName = T->identifier();
-//	outFile << '<' + T->tokenType() + "> " + T->identifier() + " </" + T->tokenType() + ">\n";
-	T->advance();
-	if (T->symbol() == '(') {
-//		outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
-		T->advance();
-		compileExpressionList();
-	}
-	else {
-		subroutineName += T->symbol();
-//		outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
-		T->advance();
-		subroutineName += T->identifier();
-//		outFile << '<' + T->tokenType() + "> " + T->identifier() + " </" + T->tokenType() + ">\n";
-		T->advance();
-//		outFile << '<' + T->tokenType() + "> " + T->symbol() + " </" + T->tokenType() + ">\n";
-		T->advance();
-		compileExpressionList();
-	}
-	vm->writeCall(subroutineName, argCount);
-	argCount = 0;
+AstExpr* JackAnalyzer::ASTParser::parseCall() {
+	AstExpr* e = parseCallName();
+	e->left = parseExpressionList();
+	T->skip(')');
+	return e;
 }
 
-void JackAnalyzer::CompilationEngine::writeType() {
-	string type;	// refers to "int, char, boolean, identifier"
-	// determine type
-	if (T->tokenType() == "keyword")
-		type = T->keyWord();
-	else
-		type = T->identifier();
-//	outFile << '<' + T->tokenType() + "> " + type + " </" + T->tokenType() + ">\n";
-	T->advance();
+AstExpr* JackAnalyzer::ASTParser::parseExpressionList() {
+	AstExpr* first = nullptr;
+	AstExpr** tail = &first;
+	if (!(T->tokenType() == SYMBOL && T->symbol() == ')')) {
+		for (;;) {
+			*tail = parseExpression();
+			tail = &(*tail)->next;
+			if (!(T->tokenType() == SYMBOL && T->symbol() == ','))
+				break;
+			T->advance();
+		}
+	}
+	return first;
 }
 
 /* VMWRITER FUNCTIONS */
-JackAnalyzer::CompilationEngine::VMWriter::VMWriter(string vmFilename) {
-	outFile.open(vmFilename);
+JackAnalyzer::VMWriter::VMWriter() {
+	peephole = PEEP_ALL;
+	finished = false;
+	binary = false;
+	code.code.reserve(1 << 12);
 }
 
-void JackAnalyzer::CompilationEngine::VMWriter::writePush(string segment, int index) {
-	outFile << "push " << segment << ' ' << index << '\n';
+void JackAnalyzer::VMWriter::reset(string vmFilename, unsigned peephole, bool binary) {
+	path = vmFilename;
+	this->peephole = peephole;
+	this->binary = binary;
+	finished = false;
+	code.clear();	// keeps the instruction vector's capacity
 }
 
-void JackAnalyzer::CompilationEngine::VMWriter::writePop(string segment, int index) {
-	outFile << "pop " << segment << ' ' << index << '\n';
+void JackAnalyzer::VMWriter::writePush(SEGMENT segment, int index) {
+	code.emit(OP_PUSH, segment, index);
 }
 
-void JackAnalyzer::CompilationEngine::VMWriter::writeArithmetic(string command) {
+void JackAnalyzer::VMWriter::writePop(SEGMENT segment, int index) {
+	code.emit(OP_POP, segment, index);
+}
+
+void JackAnalyzer::VMWriter::writeArithmetic(VMOP command) {
 	// expects command to be one of the 9 ops (e.g. add, sub, neg, not, gt, etc)
-	outFile << command << endl;
+	code.emit(command);
+}
+
+void JackAnalyzer::VMWriter::writeLabel(string_view label) {
+	code.emit(OP_LABEL, SEG_NONE, 0, code.name(label));
 }
 
-void JackAnalyzer::CompilationEngine::VMWriter::writeLabel(string label) {
-	outFile << "label " << label << '\n';
+void JackAnalyzer::VMWriter::writeGoto(string_view label) {
+	code.emit(OP_GOTO, SEG_NONE, 0, code.name(label));
 }
 
-void JackAnalyzer::CompilationEngine::VMWriter::writeGoto(string label) {
-	outFile << "goto " << label << '\n';
+void JackAnalyzer::VMWriter::writeIf(string_view label) {
+	code.emit(OP_IF, SEG_NONE, 0, code.name(label));
 }
 
-void JackAnalyzer::CompilationEngine::VMWriter::writeIf(string label) {
-	outFile << "if-goto " << label << '\n';
+void JackAnalyzer::VMWriter::writeCall(string_view name, int nArgs) {
+	code.emit(OP_CALL, SEG_NONE, nArgs, code.name(name));
 }
 
-void JackAnalyzer::CompilationEngine::VMWriter::writeCall(string name, int nArgs) {
-	outFile << "call " << name << ' ' << nArgs << '\n';
+void JackAnalyzer::VMWriter::writeFunction(string_view name, int nLocals) {
+	code.emit(OP_FUNCTION, SEG_NONE, nLocals, code.name(name));
 }
 
-void JackAnalyzer::CompilationEngine::VMWriter::writeFunction(string name, int nLocals) {
-	outFile << "function " << name << ' ' << nLocals << '\n';
+void JackAnalyzer::VMWriter::writeReturn() {
+	code.emit(OP_RETURN);
 }
 
-void JackAnalyzer::CompilationEngine::VMWriter::writeReturn() {
-	outFile << "return\n";
+void JackAnalyzer::VMWriter::finish() {
+	if (finished)
+		return;	// already optimized for the Hack backend
+	finished = true;
+	if (peephole)
+		code.peephole(peephole);
+	STAT_ADD(instructions, (long long)code.code.size());
 }
 
-void JackAnalyzer::CompilationEngine::VMWriter::close() {
-	outFile.close();
+void JackAnalyzer::VMWriter::close() {
+	finish();
+	write(code, path, binary);
+}
+
+void JackAnalyzer::VMWriter::write(const VMCode& code, string path, bool binary) {
+	STAT_TIMER(emitNs);
+	string buf;
+	if (binary)
+		code.writeBinary(buf);
+	else
+		code.print(buf);
+	STAT_ADD(bytes, (long long)buf.size());
+	// one open, one write, one close for the whole class
+	ofstream outFile(path, ios::binary);
+	if (!outFile.write(buf.data(), buf.size()))
+		throw runtime_error("cannot write " + path);
+}
+
+/* XMLWRITER FUNCTIONS */
+void JackAnalyzer::XMLWriter::reset(string xmlFilename) {
+	path = xmlFilename;
+	buf.clear();
+	depth = 0;
+}
+
+void JackAnalyzer::XMLWriter::indent() {
+	buf.append(2 * depth, ' ');
+}
+
+void JackAnalyzer::XMLWriter::open(const char* rule) {
+	indent();
+	buf += '<';
+	buf += rule;
+	buf += ">\n";
+	depth++;
+}
+
+void JackAnalyzer::XMLWriter::close(const char* rule) {
+	depth--;
+	indent();
+	buf += "</";
+	buf += rule;
+	buf += ">\n";
+}
+
+void JackAnalyzer::XMLWriter::token(JackTokenizer* T) {
+	static const char* tags[] = { "keyword", "symbol", "identifier", "integerConstant", "stringConstant" };
+	const char* tag = tags[T->tokenType()];
+	string_view text = T->tokenType() == STRING_CONST ? T->stringVal() : T->tokenText();
+
+	indent();
+	buf += '<';
+	buf += tag;
+	buf += "> ";
+	for (char c : text) {
+		switch (c) {
+		case '<': buf += "&lt;"; break;
+		case '>': buf += "&gt;"; break;
+		case '&': buf += "&amp;"; break;
+		case '"': buf += "&quot;"; break;
+		default: buf += c; break;
+		}
+	}
+	buf += " </";
+	buf += tag;
+	buf += ">\n";
+}
+
+void JackAnalyzer::XMLWriter::write() {
+	if (path.empty())
+		return;
+	ofstream outFile(path, ios::binary);
+	if (!outFile.write(buf.data(), buf.size()))
+		throw runtime_error("cannot write " + path);
 }
 
 /* SYMBOL TABLE FUNCTIONS */
 JackAnalyzer::SymbolTable::SymbolTable() {
-	classScope = new unordered_map<string, JackAnalyzer::details>;
-	subScope = new unordered_map<string, JackAnalyzer::details>;
+	subGen = 1;
+	for (int& n : counts)
+		n = 0;
 }
 
-JackAnalyzer::SymbolTable::~SymbolTable() {
-	delete classScope;
-	delete subScope;
+void JackAnalyzer::SymbolTable::reset() {
+	classSyms.clear();
+	subSyms.clear();
+	subStamp.clear();
+	subGen = 1;
+	for (int& n : counts)
+		n = 0;
 }
 
 void JackAnalyzer::SymbolTable::startSubroutine() {
-	subScope->clear();
+	subGen++;	// every subroutine slot is now stale
+	counts[ARG] = counts[VAR] = 0;
 }
 
-void JackAnalyzer::SymbolTable::Define(string name, string type, KIND k) {
-	int index;
+void JackAnalyzer::SymbolTable::Define(int name, int type, KIND k) {
 	details S;
 	// generate index
-	index = VarCount(k);
-	S.index = index;
+	S.index = counts[k]++;
 	S.type = type;
 	S.kind = k;
-	if(k == JackAnalyzer::STATIC || k == JackAnalyzer::FIELD)
-		classScope->insert(pair<string, details>(name, S));
-	else
-		subScope->insert(pair<string, details>(name, S));
-}
-
-int JackAnalyzer::SymbolTable::VarCount(KIND k) {
-	int count = 0;
-	unordered_map<string, details>::iterator it;
 	if (k == JackAnalyzer::STATIC || k == JackAnalyzer::FIELD) {
-		it = classScope->begin();
-		while (it != classScope->end())
-		{
-			if (it->second.kind == k)
-				count++;
-			++it;
-		}
+		if (name >= (int)classSyms.size())
+			classSyms.resize(name + 1, details{ -1, NONE, 0 });
+		classSyms[name] = S;
 	}
 	else {
-		it = subScope->begin();
-		while (it != subScope->end())
-		{
-			if (it->second.kind == k)
-				count++;
-			++it;
+		if (name >= (int)subSyms.size()) {
+			subSyms.resize(name + 1);
+			subStamp.resize(name + 1, 0);
 		}
+		subSyms[name] = S;
+		subStamp[name] = subGen;
 	}
-	return count;
 }
 
-JackAnalyzer::KIND JackAnalyzer::SymbolTable::kindOf(string name) {
-	if (classScope->find(name) == classScope->end())
-		return subScope->find(name)->second.kind;
-	else if (subScope->find(name) == subScope->end())
-		return NONE;
-	else
-		return classScope->find(name)->second.kind;
+int JackAnalyzer::SymbolTable::VarCount(KIND k) {
+	return counts[k];
 }
 
-string JackAnalyzer::SymbolTable::TypeOf(string name) {
-	if (classScope->find(name) == classScope->end())
-		return subScope->find(name)->second.type;
-	else
-		return classScope->find(name)->second.type;
+JackAnalyzer::details JackAnalyzer::SymbolTable::lookup(int name) {
+	STAT_ADD(lookups, 1);
+	// subroutine scope hides class scope
+	if (name < (int)subSyms.size() && subStamp[name] == subGen)
+		return subSyms[name];
+	if (name < (int)classSyms.size())
+		return classSyms[name];
+	return details{ -1, NONE, 0 };
 }
 
-int JackAnalyzer::SymbolTable::IndexOf(string name) {
-	if (classScope->find(name) == classScope->end())
-		return subScope->find(name)->second.index;
-	else
-		return classScope->find(name)->second.index;
+JackAnalyzer::KIND JackAnalyzer::SymbolTable::kindOf(int name) {
+	return lookup(name).kind;
 }
+
+int JackAnalyzer::SymbolTable::TypeOf(int name) {
+	return lookup(name).type;
+}
+
+int JackAnalyzer::SymbolTable::IndexOf(int name) {
+	return lookup(name).index;
+}
\ No newline at end of file
@@ -1,6 +1,16 @@
 #pragma once
 #include <fstream>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string_view>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "VMCode.h"
+#include "JackStats.h"
+#include "JackAST.h"
+#include "CodeWriter.h"
 
 class JackAnalyzer {	// take in directory as argument
 	/*
@@ -8,6 +18,31 @@ class JackAnalyzer {	// take in directory as argument
 		2. Create an output file called Xxx.xml and prepare it for writing.
 		3. Use the CompilationEngine to compile the input JackTokenizer into the output file.
 	*/
+public:
+	enum OUTPUT {
+		OUT_VM,
+		OUT_XML,	// parse tree only
+		OUT_BOTH
+	};
+	struct Options {
+		bool buffered = true;	// whole-file tokenizer; false = original per-character stream path
+		bool cache = true;	// reuse .vm files the .jackcache manifest shows are up to date
+		int jobs = 0;	// worker threads in directory mode; 0 = one per core
+		unsigned peephole = PEEP_ALL;	// VMCode peephole passes run on every class
+		bool fold = true;	// evaluate operators on constants at compile time (16-bit wraparound)
+		bool reduce = true;	// multiply/divide by cheap constants without calling Math
+		bool tailCalls = true;	// a subroutine returning a call to itself rebinds its arguments and jumps back to its top instead
+		bool pool = false;	// build each string literal once into a static; literals become shared objects
+		OUTPUT output = OUT_VM;	// anything but OUT_VM turns the build cache off
+		bool ast = false;	// parse each class into a tree first, then generate from it; same output (VM only)
+		bool hack = false;	// lower the program straight to Hack assembly: Xxx.asm, or Dir/Dir.asm with bootstrap; no build cache
+		bool trampolines = false;	// with hack: call, return and compares jump to one shared copy; smaller ROM, slower calls
+		bool keepVM = false;	// with hack: still write the .vm files, for debugging
+		bool binary = false;	// write Xxx.vmb (VMCode::writeBinary) instead of .vm text
+		bool prune = false;	// directory mode: leave out subroutines no call chain from Sys.init/Main.main reaches; no build cache
+		int inlineSize = 0;	// directory mode: copy subroutines of at most this many instructions into their callers, in any class; 0 = off; no build cache
+	};
+private:
 	enum KIND {
 		STATIC,
 		FIELD,
@@ -15,78 +50,291 @@ class JackAnalyzer {	// take in directory as argument
 		VAR,
 		NONE
 	};
+	enum TOKENTYPE {
+		KEYWORD,
+		SYMBOL,
+		IDENTIFIER,
+		INT_CONST,
+		STRING_CONST
+	};
+	enum KEYWORDTYPE {	// K_ prefix keeps these apart from KIND and from platform macros (NULL, TRUE, VOID...)
+		K_CLASS,
+		K_METHOD,
+		K_FUNCTION,
+		K_CONSTRUCTOR,
+		K_INT,
+		K_BOOLEAN,
+		K_CHAR,
+		K_VOID,
+		K_VAR,
+		K_STATIC,
+		K_FIELD,
+		K_LET,
+		K_DO,
+		K_IF,
+		K_ELSE,
+		K_WHILE,
+		K_RETURN,
+		K_TRUE,
+		K_FALSE,
+		K_NULL,
+		K_THIS,
+		K_NONE	// not a keyword
+	};
 	struct details {
-		std::string type;
+		int type;	// interned name of the type (int, char, boolean or a class)
 		KIND kind;
 		int index;
 	};
 	class JackTokenizer {
 		/* Removes all comments and white space from the input stream
 		and breaks it into Jack language tokens, as specified by the Jack grammar.
+		The whole file is lexed up front into the token arrays; advance() just moves to the next entry.
 		*/
-		std::string curTokn;
-		std::string t;
+		bool buffered;	// scan whole file from memory instead of pulling chars through jackFile
 		std::ifstream jackFile;
-		std::string keyOrIdent();	// determines if token is a keyword or identifier
+		std::string src;	// arena: entire input file when buffered, token text when streaming, plus interned names
+		const char* p;	// current scan position in src
+		const char* end;
+		// token stream as struct of arrays; last entry is an empty sentinel token
+		std::vector<unsigned char> kinds;	// TOKENTYPE
+		std::vector<unsigned> offs;	// token text in src
+		std::vector<unsigned> lens;
+		std::vector<int> ids;	// KEYWORDTYPE, symbol char, int value, or interned name id
+		int cur;	// current token (the sentinel until the first advance())
+		int next;
+		// interned names: id -> text in src, found through an open-addressing table of ids
+		std::vector<unsigned> nameOffs;
+		std::vector<unsigned> nameLens;
+		std::vector<int> nameSlots;	// -1 = empty
+		static KEYWORDTYPE keyOrIdent(std::string_view word);	// perfect-hash keyword lookup; K_NONE means identifier
+		bool scanStream();	// original per-character ifstream path, kept for comparison
+		bool scanBuffer();	// raw pointer scan over src
+		void addToken(TOKENTYPE type, size_t off, size_t len, int id);
+		int internAt(size_t off, size_t len);	// interns text that is already in src
+		void lex();	// fills the token arrays from src or jackFile
 	public: 
-		JackTokenizer(std::string filename);	// opens input file/stream & gets ready to tokenize it
+		JackTokenizer();	// no tokens until reset()
+		JackTokenizer(std::string filename, bool buffered = true);	// opens input file/stream & lexes all of it
+		void reset(std::string_view source);	// lexes source from memory instead, reusing this tokenizer's storage
 		bool hasMoreTokens();	// more tokens in the input?
-		void advance();	// grabs next token if hasMoreTokens() & determines its type; initially no current token
-		std::string tokenType();	// returns type of current token
+		void advance();	// grabs next token if hasMoreTokens() & determines its type; initially no current token, and none again past the last
+		void skip(char symbol);	// advance() past the current token, which must be symbol; throws a parse error otherwise
+		std::string found();	// the current token quoted for an error message, or "end of file"
+		TOKENTYPE tokenType();	// returns type of current token
 		// functions that are called depending on tokenType()
-		std::string keyWord(); // returns keyword which is the current token; only called when tokenType() = KEYWORD
+		KEYWORDTYPE keyWord(); // returns keyword which is the current token; only called when tokenType() = KEYWORD
 		char symbol();	// returns character which is current token; called when tokenType() = SYMBOL
-		std::string identifier();	// returns identifier which is current token; tokenType = IDENTIFIER
+		std::string_view identifier();	// returns identifier which is current token; tokenType = IDENTIFIER
 		int intVal();	// returns int val of current token; tokenType() = INT_CONSTANT
-		std::string stringVal();	// returns string value of current token; tokenType = STRING_CONSTANT
-
+		std::string_view stringVal();	// returns string value of current token; tokenType = STRING_CONSTANT
+		std::string_view tokenText();	// raw text of the current token, whatever its type (types, diagnostics)
+		std::string_view tokenText(int token);	// text of the token at position(); src may have grown since
+		int position();	// index of the current token
+		int identifierId();	// interned id of the current identifier; equal names get equal ids
+		TOKENTYPE peekType(int n = 1);	// type of the token n places ahead, without advancing
+		char peekSymbol(int n = 1);	// symbol n places ahead ('\0' if not a symbol)
+		int intern(std::string_view name);	// id for a name that need not appear in the source (e.g. "this")
+		std::string_view name(int id);	// text of an interned id
+		int tokenCount();	// tokens lexed from the file
 	};
 	class SymbolTable {
-		std::unordered_map<std::string, JackAnalyzer::details>* classScope;
-		std::unordered_map<std::string, JackAnalyzer::details>* subScope;
+		/* Both scopes are flat arrays indexed directly by interned name id, so a lookup is one
+		array probe. A subroutine slot only counts if its stamp matches subGen, which makes
+		startSubroutine() O(1) and lets every subroutine reuse the same storage.
+		*/
+		std::vector<details> classSyms;	// kind NONE = not defined in class scope
+		std::vector<details> subSyms;
+		std::vector<unsigned> subStamp;	// subroutine generation each subSyms slot was defined in
+		unsigned subGen;
+		int counts[NONE];	// running index per KIND
 	public:
 		SymbolTable();	// creates new empty symbol table
-		~SymbolTable();
+		void reset();	// empties both scopes for the next class, keeping the storage
 		void startSubroutine();	// starts new subroutine scope (reset subroutine symbol table)
 		/*
 		*	Defines a new identifier of a given name, type, and kind
 		*	Assigns it a running index. STATIC/FIELD have class scope
 		*	ARG/VAR have subroutine scope
 		*/
-		void Define(std::string name, std::string type, KIND k);
+		void Define(int name, int type, KIND k);
 		int VarCount(KIND k);	// returns num of variables of the given KIND defined in the current scope
-		JackAnalyzer::KIND kindOf(std::string name);	// returns KIND of named identifier in current scope. if identifier is unknown returns NONE
-		std::string TypeOf(std::string name);	// returns type of the named identifier in current scope
-		int IndexOf(std::string name);	// returns index assigned to the named identifier
+		details lookup(int name);	// kind, type and index of the named identifier in one probe; kind NONE if unknown
+		JackAnalyzer::KIND kindOf(int name);	// returns KIND of named identifier in current scope. if identifier is unknown returns NONE
+		int TypeOf(int name);	// returns type of the named identifier in current scope
+		int IndexOf(int name);	// returns index assigned to the named identifier
 	};
-	class CompilationEngine {
-		class VMWriter {
-			std::ofstream outFile;
-		public:
-			VMWriter(std::string vmFilename);
-			void writePush(std::string segment, int index);
-			void writePop(std::string segment, int index);
-			void writeArithmetic(std::string command);
-			void writeLabel(std::string label);
-			void writeGoto(std::string label);
-			void writeIf(std::string label);
-			void writeCall(std::string name, int nArgs);
-			void writeFunction(std::string name, int nLocals);
-			void writeReturn();
-			void close();
+	class VMWriter {
+		/* Records the class as typed VM instructions; close() runs the peephole
+		pass over them and writes the .vm text (or the .vmb image) in one bulk write.
+		*/
+		std::string path;
+		unsigned peephole;	// PEEPHOLE passes to run before writing
+		bool finished;
+		bool binary;
+	public:
+		VMCode code;
+		VMWriter();
+		void reset(std::string vmFilename, unsigned peephole, bool binary = false);	// starts a new class; empty name = never written
+		void writePush(SEGMENT segment, int index);
+		void writePop(SEGMENT segment, int index);
+		void writeArithmetic(VMOP command);
+		void writeLabel(std::string_view label);
+		void writeGoto(std::string_view label);
+		void writeIf(std::string_view label);
+		void writeCall(std::string_view name, int nArgs);
+		void writeFunction(std::string_view name, int nLocals);
+		void writeReturn();
+		void finish();	// runs the peephole pass; code is final afterwards
+		void close();	// optimizes and writes the code out; throws if the file cannot be written
+		static void write(const VMCode& code, std::string path, bool binary);	// code as .vm text or .vmb, in one bulk write
+	};
+	class XMLWriter {
+		/* Parse tree in the nand2tetris .xml format: one element per grammar rule,
+		one per token, two spaces of indent per level. Buffered and written in one go like VMWriter.
+		*/
+		std::string path;
+		std::string buf;
+		int depth;
+		void indent();
+	public:
+		void reset(std::string xmlFilename);	// empty name = never written
+		void open(const char* rule);	// <rule>
+		void close(const char* rule);	// </rule>
+		void token(JackTokenizer* T);	// current token, escaped
+		void write();	// throws if the file cannot be written
+	};
+	struct NoXML {	// stands in for XMLWriter when no tree is wanted; every call compiles to nothing
+		void reset(const std::string&) {}
+		void open(const char*) {}
+		void close(const char*) {}
+		void token(JackTokenizer*) {}
+		void write() {}
+	};
+	struct NoVM {	// stands in for VMWriter when only the tree is wanted; every call compiles to nothing
+		void reset(const std::string&, unsigned, bool) {}
+		void writePush(SEGMENT, int) {}
+		void writePop(SEGMENT, int) {}
+		void writeArithmetic(VMOP) {}
+		void writeLabel(std::string_view) {}
+		void writeGoto(std::string_view) {}
+		void writeIf(std::string_view) {}
+		void writeCall(std::string_view, int) {}
+		void writeFunction(std::string_view, int) {}
+		void writeReturn() {}
+	};
+	// output policies for CompilationEngine, picked from Options::output
+	struct VMOnly { typedef VMWriter VM; typedef NoXML XML; static constexpr bool vm = true; static constexpr bool xml = false; };
+	struct XMLOnly { typedef NoVM VM; typedef XMLWriter XML; static constexpr bool vm = false; static constexpr bool xml = true; };
+	struct VMAndXML { typedef VMWriter VM; typedef XMLWriter XML; static constexpr bool vm = true; static constexpr bool xml = true; };
+	class ASTParser {
+		/* Reads one class from the tokenizer into an arena-allocated tree (JackAST.h),
+		so the engine can walk it as many times as it likes before writing code.
+		*/
+		JackTokenizer* T;
+		Arena* arena;
+		struct Frame {	// one level of nesting inside an expression, as in CompilationEngine::ExprFrame
+			char kind;	// 'e' expression, '(' parentheses, 'u' unary, '[' array index, 'c' call arguments
+			AstExpr* e;	// 'e': the expression so far; 'u', '[' and 'c': their node
+			AstExpr* open;	// 'e': binary node still waiting for its right operand
+			AstExpr** tail;	// 'c': where the next argument goes
 		};
-	//	Output xml files to a new folder.
+		std::vector<Frame> frames;
+		AstVar** declare(AstVar** tail, KIND kind);	// type name (, name)* ; appends to tail, returns the new tail
+		AstSub* parseSubroutine();
+		AstStmt* parseStatements();
+		AstStmt* parseLet();
+		AstStmt* parseIf();
+		AstStmt* parseWhile();
+		AstStmt* parseDo();
+		AstStmt* parseReturn();
+		AstExpr* parseExpression();	// on frames instead of the C++ stack; throws where a term cannot start
+		AstExpr* parseCallName();	// the call up to its (; the arguments are left to the caller
+		AstExpr* parseCall();
+		AstExpr* parseExpressionList();
+		AstExpr* node(ASTEXPR kind);
+		AstStmt* node(ASTSTMT kind);
+	public:
+		ASTParser(JackTokenizer* T, Arena* arena);
+		AstClass* parseClass();	// T is on the class keyword; the tree lives until arena is reset
+	};
+	template <class Output>
+	class CompilationEngine {
 		JackTokenizer* T;
-		VMWriter* vm;
-		std::ofstream outFile;
+		typename Output::VM vm;
+		typename Output::XML xml;
 		SymbolTable table;
 		std::string className;
-		int argCount;
+		int labelCount;	// per subroutine, keeps generated labels unique within the function
+		Options opt;
+		// string pool: literal -> static slot, guard flag in slot poolBase - 1; owned copies,
+		// since interning names can move the tokenizer's text while the class is compiled
+		std::unordered_map<std::string, int> literals;
+		std::vector<std::string> poolOrder;
+		int poolBase;
+		bool usesPool;	// current subroutine needs the init guard
+		// current subroutine, for calls to itself in tail position
+		std::string subName;
+		KEYWORDTYPE subKind;
+		size_t bodyStart;
+		std::string topLabel;	// empty until a tail call needs it
+		size_t doCall;	// the call of the do statement written last, 0 if none: do f(...); return; is known by this, not by the code's shape
+		Arena arena;	// AST of the class being compiled when opt.ast is set
 		// extra utilty
 		void writeType();	// deals w/ outputing the write code for type
-		void compileSubroutineCall();
+		void compileSubroutineCall();	// subroutineName(...) or className/varName.subroutineName(...)
+		int compileCallName(int& nArgs);	// the call up to its (: pushes the object of a method call; returns the callee's name id
+		void finishCall(int name, int nArgs);	// after the argument list: ) and the call itself
+		struct ExprFrame {	// one level of nesting inside an expression
+			char kind;	// 'e' expression, '(' parentheses, '-' or '~' unary, '[' array index, 'c' call arguments
+			char op;	// 'e': operator waiting for its right operand, 0 if none
+			size_t left;	// 'e': where the expression's code starts; unary: where the operand's starts
+			size_t right;	// 'e': where the right operand's code starts
+			int nArgs;	// 'c': arguments so far, the object included
+			int name;	// 'c': name id of the callee
+		};
+		std::vector<ExprFrame> exprStack;	// kept across expressions so it stops allocating once grown
+		void compileNested(bool term);	// compileExpression (or compileTerm) on exprStack instead of the C++ stack
+		size_t codeSize();	// where the next instruction goes; always 0 when no VM code is built
+		details lookupVar(int name);	// table.lookup, but a name never declared is an error when writing code
+		void pushVar(details var);
+		void popVar(details var);
+		void writeArrayStore();	// value, then target address, on the stack
+		size_t writePrologue(KEYWORDTYPE kind, const std::string& functionName);	// function line + this setup; returns where the body starts
+		void writePoolGuard(size_t start);	// if the body used pooled literals, builds them first
+		void writeReturn();	// the value is on the stack; a call to this subroutine just before becomes a loop
+		void writeBinary(char op, size_t left, size_t right);	// operands start at left and right; folds or reduces when it can
+		void writeUnary(VMOP op, size_t from);
+		void writeKeywordConst(KEYWORDTYPE k);	// true, false, null, this
+		void writeStringConst(std::string_view s);	// pooled or built in place
+		std::string newLabel(const char* prefix);
+		bool foldBinary(char op, size_t left, size_t right);	// code from left and from right are constants? replace with the result
+		bool foldUnary(VMOP op, size_t from);
+		bool reduceMulDiv(char op, size_t left, size_t right);	// one operand constant? inline instead of Math.multiply/divide
+		void writeMultiply(int c);	// value on the stack times c, via temp 1 and 2
+		void writeString(std::string_view s);	// String.new + appendChar chain
+		void writePoolInit();	// className.$init: builds the pooled literals and sets the guard
+		// AST path: same code as the Compile* functions, generated from the tree
+		void genClass(AstClass* c);
+		void genSubroutine(AstClass* c, AstSub* s);
+		void genStatements(AstStmt* s);
+		struct GenFrame {	// genExpression: a node whose operands are being written
+			AstExpr* e;
+			AstExpr* next;	// operand to write next, null once all are
+			size_t left;	// where the code of e starts
+			size_t right;	// AE_BINARY: where the right operand's code starts
+			int nArgs;	// AE_CALL: arguments so far, the object included
+			int name;	// AE_CALL: name id of the callee
+		};
+		std::vector<GenFrame> genStack;	// kept across expressions, like exprStack
+		void genExpression(AstExpr* e);	// post-order walk on genStack instead of the C++ stack
 	public:
-		CompilationEngine(JackTokenizer* T, std::string output);
+		CompilationEngine(const Options& opt);	// unbound until reset()
+		CompilationEngine(JackTokenizer* T, std::string output, const Options& opt);
+		void reset(JackTokenizer* T, std::string output, const Options& opt);	// next class; empty output = in memory only
+		void compile();	// compiles the class in T into VM instructions
+		void close();	// writes output.vm (kept with opt.hack only if keepVM) and/or output.xml, as Output says; throws if one cannot be written
+		const VMCode& finish();	// optimizes and hands back the code instead of writing it
 		void CompileClass();	// compiles a complete class
 		void CompileClassVarDec();	// compiles static/field declaration
 		void CompileSubroutine();	// compiles a complete method, function, or constructor
@@ -100,11 +348,89 @@ class JackAnalyzer {	// take in directory as argument
 		void compileIf();	// compiles if statement, possibly w/ else clause
 		void compileExpression();	// compiles an expression
 		void compileTerm();
-		void compileExpressionList();	// compiles (possibly empty) comma-separated list of expressions
+		int compileExpressionList();	// compiles (possibly empty) comma-separated list of expressions; returns how many
+	};
+	class ThreadPool {
+		/* Work-stealing pool: jobs are dealt out over one deque per worker;
+		a worker takes from the front of its own deque and, once that is empty,
+		steals from the back of the others. Callers hand out the biggest jobs first,
+		so each worker starts on its biggest and thieves take the small tail.
+		*/
+		int workers;
+	public:
+		ThreadPool(int workers = 0);	// 0 = one worker per core
+		void run(int n, std::function<void(int)> job);	// runs job(0) .. job(n - 1); returns when all are done
+	};
+	class BuildCache {
+		/* Incremental build manifest, kept as .jackcache next to the .vm output.
+		For every class it records the content hash of the .jack input and of the .vm
+		that was produced from it; the whole file is thrown away when the compiler stamp changes.
+		*/
+		std::string path;
+		std::string stamp;
+		std::string ext;	// of the output it vouches for: .vm or .vmb
+		std::unordered_map<std::string, std::pair<uint64_t, uint64_t>> entries;	// file name -> (jack hash, vm hash)
+		std::mutex m;	// jobs check and record entries concurrently
+		bool dirty;
+	public:
+		BuildCache(std::string dir, std::string stamp, std::string ext = ".vm");	// loads dir/.jackcache if it was written under the same stamp
+		bool upToDate(std::string jackFile, uint64_t& jackHash);	// hashes jackFile; true if its .vm can be reused
+		void record(std::string jackFile, uint64_t jackHash);	// hashes the fresh .vm and remembers both hashes
+		void keepOnly(const std::vector<std::string>& jackFiles);	// forget classes that no longer exist
+		void save();	// rewrites the manifest if anything changed
+		static bool hashFile(std::string path, uint64_t& hash);	// 64-bit FNV-1a of the file contents
+	};
+	struct Signature {	// one subroutine in the whole-program index inlineCalls() works from
+		int file;	// its class, as an index into the held code
+		int entry;	// its function command
+		int end;	// one past its last instruction
+		int locals;
+		int args;	// argument slots it uses: the parameters, plus this for a method
+		bool inlinable;	// small enough, ends in return and never calls itself
+		bool statics;	// uses its class's statics, so only its own class can take a copy
+		bool setsThis;	// writes pointer 0 (a method or constructor)
+		bool usesThis;	// reads this or pointer 0, so a copy that sets THIS must put it back
 	};
-	JackTokenizer* T;
-	CompilationEngine* C;
+	static const int inlineGrowth = 4;	// inlining may add at most 1/inlineGrowth to the program,
+	static const int inlineFloor = 256;	// or this many instructions if that is more
+	Options opt;
+	std::vector<std::string> errors;	// "file: message", in file name order
+	int skipped;
+	std::unordered_set<std::string> live;	// with prune: every subroutine a call chain from the entry point reaches
+	std::vector<std::string> removed;	// with prune: "Xxx.f" of every subroutine left out
+	int inlined;	// calls replaced by a copy of the callee
+	void compileFile(std::string input, std::string& hack, VMCode* keep);	// Xxx.jack -> Xxx.vm (and its Hack assembly, with opt.hack) with its own tokenizer/engine/writer; with keep, the code goes there instead; throws on failure
+	template <class Output>
+	void compileFileWith(std::string input, std::string& hack, VMCode* keep);
+	void lower(const VMCode& code, std::string input, std::string& hack);	// Hack assembly of one class
+	void inlineCalls(std::vector<VMCode>& codes);	// replaces calls to small subroutines with a copy of their body
+	void prune(std::string input, std::vector<VMCode>& codes);	// works out live over every class and extra .vm file, then drops the rest from codes
+	void dropDead(VMCode& code);	// removes the functions that are not live
+	void link(std::string input, std::vector<std::string>& hack);	// writes the .asm of the whole program
+	std::string stamp();	// compiler version plus every option that changes the generated code
+	struct Context;	// per-thread tokenizer + engine reused by compileSource
+	friend struct JackBench;	// bench/JackBench.cpp times the phases one at a time
+#ifdef JACK_STATS
+	std::vector<JackStats::File> stats;	// per file, in file name order
+	double wallMs;
+#endif
 public:
-	JackAnalyzer(std::string input, std::string output);
-	~JackAnalyzer();
+	JackAnalyzer(std::string input, std::string output);	// input is a .jack file or a directory of them
+	JackAnalyzer(std::string input, std::string output, Options opt);
+	int failures();	// number of files that failed to compile
+	int reused();	// number of files whose .vm was up to date and left alone
+	const std::vector<std::string>& pruned();	// subroutines Options::prune left out, in file name order
+	/*
+	*	In-memory compiler for one class of Jack source: no files are read or written.
+	*	Safe to call from several threads; each thread reuses its own tokenizer and engine,
+	*	so no tokenizer or engine is built or torn down per call. Their token, symbol and
+	*	code arrays keep their capacity, but names, labels and the peephole pass still allocate.
+	*/
+	static void compileSource(std::string_view source, std::string& vm);	// appends the .vm text
+	static void compileSource(std::string_view source, std::string& vm, const Options& opt);
+	static const VMCode& compileSourceIR(std::string_view source);	// valid until this thread's next call
+	static const VMCode& compileSourceIR(std::string_view source, const Options& opt);
+#ifdef JACK_STATS
+	void writeStats(std::ostream& out);	// JSON report of the build
+#endif
 };
\ No newline at end of file
@@ -0,0 +1,80 @@
+#include "JackStats.h"
+#ifdef JACK_STATS
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+
+thread_local JackStats::File* JackStats::current = nullptr;
+
+/* ALLOCATION COUNTING */
+// replaces the global allocator for the whole program; only the thread compiling a file is charged
+void* operator new(size_t n) {
+	void* p = malloc(n ? n : 1);
+	if (!p)
+		throw bad_alloc();
+	if (JackStats::current) {
+		JackStats::current->allocs++;
+		JackStats::current->allocBytes += (long long)n;
+	}
+	return p;
+}
+
+void operator delete(void* p) noexcept {
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+	free(p);
+}
+
+/* JSON REPORT */
+static void putString(ostream& out, const string& s) {
+	out << '"';
+	for (char c : s) {
+		if (c == '"' || c == '\\')
+			out << '\\' << c;
+		else if ((unsigned char)c < 0x20)
+			out << ' ';
+		else
+			out << c;
+	}
+	out << '"';
+}
+
+static void putCounters(ostream& out, const JackStats::File& f) {
+	out << "\"lexMs\": " << f.lexNs / 1e6 << ", \"parseMs\": " << f.parseNs / 1e6 << ", \"emitMs\": " << f.emitNs / 1e6
+		<< ", \"tokens\": " << f.tokens << ", \"lookups\": " << f.lookups << ", \"instructions\": " << f.instructions
+		<< ", \"bytes\": " << f.bytes << ", \"allocs\": " << f.allocs << ", \"allocBytes\": " << f.allocBytes;
+}
+
+void JackStats::writeJSON(ostream& out, const string& stamp, int jobs, double wallMs, const vector<File>& files) {
+	File total;
+	int cached = 0;
+
+	out << "{\n  \"compiler\": ";
+	putString(out, stamp);
+	out << ",\n  \"jobs\": " << jobs << ",\n  \"wallMs\": " << wallMs << ",\n  \"files\": [";
+	for (size_t i = 0; i < files.size(); i++) {
+		const File& f = files[i];
+		out << (i ? ",\n    {" : "\n    {") << "\"name\": ";
+		putString(out, f.name);
+		out << ", \"cached\": " << (f.cached ? "true" : "false") << ", ";
+		putCounters(out, f);
+		out << '}';
+		cached += f.cached;
+		total.lexNs += f.lexNs;
+		total.parseNs += f.parseNs;
+		total.emitNs += f.emitNs;
+		total.tokens += f.tokens;
+		total.lookups += f.lookups;
+		total.instructions += f.instructions;
+		total.bytes += f.bytes;
+		total.allocs += f.allocs;
+		total.allocBytes += f.allocBytes;
+	}
+	out << "\n  ],\n  \"total\": {\"files\": " << files.size() << ", \"cached\": " << cached << ", ";
+	putCounters(out, total);
+	out << "}\n}\n";
+}
+#endif
@@ -0,0 +1,49 @@
+#pragma once
+/*
+*	Opt-in compiler instrumentation. Build with -DJACK_STATS (and JackStats.cpp) to time lexing,
+*	parsing and emission per file, count tokens, symbol lookups, VM instructions, bytes written
+*	and heap allocations, and write the lot as a JSON report (JackCompiler --stats report.json).
+*	Without JACK_STATS the STAT_* macros expand to nothing and no counters exist.
+*/
+#ifdef JACK_STATS
+#include <chrono>
+#include <ostream>
+#include <string>
+#include <vector>
+
+struct JackStats {
+	struct File {
+		std::string name;
+		bool cached = false;	// .vm reused from the build cache, nothing below was measured
+		long long lexNs = 0;
+		long long parseNs = 0;
+		long long emitNs = 0;
+		long long tokens = 0;
+		long long lookups = 0;	// SymbolTable lookups
+		long long instructions = 0;	// VM instructions written, after the peephole pass
+		long long bytes = 0;	// .vm bytes written
+		long long allocs = 0;	// operator new calls on the compiling thread
+		long long allocBytes = 0;
+	};
+	static thread_local File* current;	// file being compiled on this thread, or null
+
+	class Timer {	// adds the lifetime of the scope to a File counter
+		long long File::* field;
+		std::chrono::steady_clock::time_point t0;
+	public:
+		Timer(long long File::* field) : field(field), t0(std::chrono::steady_clock::now()) {}
+		~Timer() {
+			if (current)
+				current->*field += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+		}
+	};
+
+	static void writeJSON(std::ostream& out, const std::string& stamp, int jobs, double wallMs, const std::vector<File>& files);
+};
+
+#define STAT_ADD(field, n) (JackStats::current ? (void)(JackStats::current->field += (n)) : (void)0)
+#define STAT_TIMER(field) JackStats::Timer statTimer_##field(&JackStats::File::field)
+#else
+#define STAT_ADD(field, n) ((void)0)
+#define STAT_TIMER(field) ((void)0)
+#endif
@@ -0,0 +1,862 @@
+#include "VMCode.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_set>
+
+using namespace std;
+
+static const char* opNames[] = {
+	"push", "pop", "add", "sub", "neg", "eq", "gt", "lt", "and", "or", "not",
+	"label", "goto", "if-goto", "if-goto", "call", "function", "return"
+};
+static const char* segNames[] = {
+	"constant", "argument", "local", "static", "this", "that", "pointer", "temp", ""
+};
+
+/* VMCODE FUNCTIONS */
+int VMCode::name(string_view s) {
+	unordered_map<string_view, int>::iterator it = ids.find(s);
+	if (it != ids.end())
+		return it->second;
+	names.emplace_back(s);
+	ids.emplace(names.back(), (int)names.size() - 1);
+	return (int)names.size() - 1;
+}
+
+string_view VMCode::nameOf(int id) const {
+	return names[id];
+}
+
+void VMCode::emit(VMOP op, SEGMENT seg, int arg, int name) {
+	code.push_back(VMInstr{ (unsigned char)op, (unsigned char)seg, arg, name });
+}
+
+void VMCode::append(const VMCode& other) {
+	code.reserve(code.size() + other.code.size());
+	for (const VMInstr& in : other.code)
+		emit((VMOP)in.op, (SEGMENT)in.seg, in.arg, in.name < 0 ? -1 : name(other.nameOf(in.name)));
+}
+
+void VMCode::clear() {
+	code.clear();
+	names.clear();
+	ids.clear();
+}
+
+static void putInt(string& out, int n) {	// hand-rolled decimal formatting
+	char digits[12];
+	char* d = digits + sizeof digits;
+	unsigned u = n < 0 ? 0u - (unsigned)n : (unsigned)n;
+
+	do {
+		*--d = (char)('0' + u % 10);
+		u /= 10;
+	} while (u != 0);
+	if (n < 0)
+		*--d = '-';
+	out.append(d, digits + sizeof digits - d);
+}
+
+void VMCode::print(string& out) const {
+	out.reserve(out.size() + code.size() * 12);
+	for (const VMInstr& in : code) {
+		switch (in.op) {
+		case OP_PUSH:
+		case OP_POP:
+			out += opNames[in.op];
+			out += ' ';
+			out += segNames[in.seg];
+			out += ' ';
+			putInt(out, in.arg);
+			break;
+		case OP_IFNOT:
+			out += "not\n";
+			// fall through
+		case OP_LABEL:
+		case OP_GOTO:
+		case OP_IF:
+			out += opNames[in.op];
+			out += ' ';
+			out += names[in.name];
+			break;
+		case OP_CALL:
+		case OP_FUNCTION:
+			out += opNames[in.op];
+			out += ' ';
+			out += names[in.name];
+			out += ' ';
+			putInt(out, in.arg);
+			break;
+		default:	// arithmetic and return
+			out += opNames[in.op];
+			break;
+		}
+		out += '\n';
+	}
+}
+
+static bool nextWord(string_view& line, string_view& word) {	// splits off the next blank-separated word
+	size_t b = line.find_first_not_of(" \t\r"), e;
+	if (b == string_view::npos)
+		return false;
+	e = line.find_first_of(" \t\r", b);
+	word = line.substr(b, e == string_view::npos ? string_view::npos : e - b);
+	line = e == string_view::npos ? string_view() : line.substr(e);
+	return true;
+}
+
+static bool number(string_view word, int& n) {
+	n = 0;
+	if (word.empty() || word.size() > 6)
+		return false;
+	for (char c : word) {
+		if (c < '0' || c > '9')
+			return false;
+		n = n * 10 + (c - '0');
+	}
+	return true;
+}
+
+static bool fits(int op, int seg) {	// segment usage parse() and readBinary() both hold an instruction to
+	if (op == OP_PUSH || op == OP_POP)
+		return seg < SEG_NONE && !(op == OP_POP && seg == SEG_CONST);
+	return seg == SEG_NONE;
+}
+
+void VMCode::parse(string_view text) {
+	string_view whole, line, word, arg;
+	size_t eol;
+	int lineNo = 0, op, seg, n;
+
+	while (!text.empty()) {
+		eol = text.find('\n');
+		whole = line = text.substr(0, eol);
+		text = eol == string_view::npos ? string_view() : text.substr(eol + 1);
+		lineNo++;
+		line = line.substr(0, line.find("//"));
+		if (!nextWord(line, word))
+			continue;	// blank or comment only
+		for (op = 0; op <= OP_RETURN && word != opNames[op]; op++)
+			;
+		switch (op) {
+		case OP_PUSH:
+		case OP_POP:
+			if (!nextWord(line, word) || !nextWord(line, arg) || !number(arg, n))
+				break;
+			for (seg = 0; seg < SEG_NONE && word != segNames[seg]; seg++)
+				;
+			if (!fits(op, seg))
+				break;
+			emit((VMOP)op, (SEGMENT)seg, n);
+			continue;
+		case OP_LABEL:
+		case OP_GOTO:
+		case OP_IF:
+			if (!nextWord(line, word))
+				break;
+			emit((VMOP)op, SEG_NONE, 0, name(word));
+			continue;
+		case OP_CALL:
+		case OP_FUNCTION:
+			if (!nextWord(line, word) || !nextWord(line, arg) || !number(arg, n))
+				break;
+			emit((VMOP)op, SEG_NONE, n, name(word));
+			continue;
+		case OP_IFNOT:	// never matched: "if-goto" finds OP_IF first
+		case OP_RETURN + 1:
+			break;
+		default:	// arithmetic and return
+			emit((VMOP)op);
+			continue;
+		}
+		throw runtime_error("line " + to_string(lineNo) + ": cannot read \"" + string(whole) + "\"");
+	}
+}
+
+/* BINARY FORMAT */
+static const char vmbMagic[4] = { 'V', 'M', 'B', '1' };
+
+static uint32_t align4(size_t n) {
+	return (uint32_t)((n + 3) & ~(size_t)3);
+}
+
+bool VMCode::isBinary(string_view data) {
+	return data.size() >= sizeof(VMBHeader) && memcmp(data.data(), vmbMagic, 4) == 0;
+}
+
+void VMCode::writeBinary(string& out) const {
+	VMBHeader h;
+	vector<VMBFunction> functions;
+	size_t base = out.size(), strings = 0;
+
+	for (size_t i = 0; i < code.size(); i++) {
+		if (code[i].op == OP_FUNCTION)
+			functions.push_back(VMBFunction{ (uint32_t)code[i].name, (uint32_t)i });
+	}
+	for (const string& s : names)
+		strings += s.size() + 1;
+	memcpy(h.magic, vmbMagic, 4);
+	h.instructions = (uint32_t)code.size();
+	h.functions = (uint32_t)functions.size();
+	h.names = (uint32_t)names.size();
+	h.code = align4(sizeof h);
+	h.functionIndex = h.code + h.instructions * (uint32_t)sizeof(VMBInstr);
+	h.nameIndex = h.functionIndex + h.functions * (uint32_t)sizeof(VMBFunction);
+	h.strings = h.nameIndex + h.names * (uint32_t)sizeof(VMBName);
+	h.size = align4(h.strings + strings);
+
+	out.resize(base + h.size, '\0');
+	char* p = &out[base];
+	memcpy(p, &h, sizeof h);
+	for (size_t i = 0; i < code.size(); i++) {
+		const VMInstr& in = code[i];
+		if (in.arg < 0 || in.arg > 0xFFFF)
+			throw runtime_error("vmb: argument " + to_string(in.arg) + " does not fit in 16 bits");
+		VMBInstr b = { in.op, in.seg, (uint16_t)in.arg, in.name };
+		memcpy(p + h.code + i * sizeof b, &b, sizeof b);
+	}
+	if (!functions.empty())
+		memcpy(p + h.functionIndex, functions.data(), functions.size() * sizeof(VMBFunction));
+	uint32_t offset = 0;
+	for (size_t i = 0; i < names.size(); i++) {
+		VMBName n = { offset, (uint32_t)names[i].size() };
+		memcpy(p + h.nameIndex + i * sizeof n, &n, sizeof n);
+		memcpy(p + h.strings + offset, names[i].data(), names[i].size());
+		offset += n.length + 1;	// the NUL is already there
+	}
+}
+
+void VMCode::readBinary(string_view data) {
+	VMBHeader h;
+	vector<int> ids;	// file name index -> id in this VMCode
+	VMBInstr b;
+	VMBName n;
+
+	if (!isBinary(data))
+		throw runtime_error("vmb: not a .vmb file");
+	memcpy(&h, data.data(), sizeof h);
+	// every section has to lie inside the data before anything is read from it
+	if (h.size > data.size() || h.code < sizeof h ||
+		(uint64_t)h.code + (uint64_t)h.instructions * sizeof(VMBInstr) > h.functionIndex ||
+		(uint64_t)h.functionIndex + (uint64_t)h.functions * sizeof(VMBFunction) > h.nameIndex ||
+		(uint64_t)h.nameIndex + (uint64_t)h.names * sizeof(VMBName) > h.strings || h.strings > h.size)
+		throw runtime_error("vmb: truncated or damaged header");
+	for (uint32_t i = 0; i < h.names; i++) {
+		memcpy(&n, data.data() + h.nameIndex + i * sizeof n, sizeof n);
+		if ((uint64_t)h.strings + n.offset + n.length > h.size)
+			throw runtime_error("vmb: name " + to_string(i) + " lies outside the file");
+		ids.push_back(name(data.substr(h.strings + n.offset, n.length)));
+	}
+	code.reserve(code.size() + h.instructions);
+	for (uint32_t i = 0; i < h.instructions; i++) {
+		memcpy(&b, data.data() + h.code + i * sizeof b, sizeof b);
+		bool named = b.op >= OP_LABEL && b.op <= OP_FUNCTION;
+		if (b.op > OP_RETURN || !fits(b.op, b.seg) || (named && (b.name < 0 || (uint32_t)b.name >= h.names)))
+			throw runtime_error("vmb: bad instruction " + to_string(i));
+		emit((VMOP)b.op, (SEGMENT)b.seg, b.arg, named ? ids[b.name] : -1);
+	}
+}
+
+/* PEEPHOLE OPTIMIZER */
+/*
+*	Value of the constant group ending at the top of out: "push constant c" followed by
+*	any run of neg/not. Returns the group length, or 0 if the tail is not a constant.
+*/
+static int constantTail(const vector<VMInstr>& out, int& value) {
+	// out never ends in a constant with more than two neg/not after it: each one is folded
+	// as it comes in unless that makes it longer. So a long run ahead of k is never a
+	// constant, and looking further back would make a chain of unary ops quadratic.
+	int n = (int)out.size(), k = n;
+	while (k > 0 && n - k < 2 && (out[k - 1].op == OP_NEG || out[k - 1].op == OP_NOT))
+		k--;
+	if (k == 0 || out[k - 1].op != OP_PUSH || out[k - 1].seg != SEG_CONST)
+		return 0;
+	value = out[k - 1].arg;
+	for (int i = k; i < n; i++)
+		value = (short)(out[i].op == OP_NEG ? -value : ~value);	// 16-bit two's complement
+	return n - k + 1;
+}
+
+static void pushConstant(vector<VMInstr>& out, int value) {	// shortest form of a 16-bit constant
+	value = (short)value;
+	if (value >= 0)
+		out.push_back(VMInstr{ OP_PUSH, SEG_CONST, value, -1 });
+	else if (value == -32768) {
+		out.push_back(VMInstr{ OP_PUSH, SEG_CONST, 32767, -1 });
+		out.push_back(VMInstr{ OP_NOT, SEG_NONE, 0, -1 });
+	}
+	else {
+		out.push_back(VMInstr{ OP_PUSH, SEG_CONST, -value, -1 });
+		out.push_back(VMInstr{ OP_NEG, SEG_NONE, 0, -1 });
+	}
+}
+
+static int constantLength(int value) {
+	return (short)value >= 0 ? 1 : 2;
+}
+
+bool VMCode::isConstant(size_t from, size_t to, int& value) {
+	if (from >= to || code[from].op != OP_PUSH || code[from].seg != SEG_CONST)
+		return false;
+	value = code[from].arg;
+	for (size_t i = from + 1; i < to; i++) {
+		if (code[i].op == OP_NEG)
+			value = (short)-value;
+		else if (code[i].op == OP_NOT)
+			value = (short)~value;
+		else
+			return false;
+	}
+	return true;
+}
+
+void VMCode::emitConstant(int value) {
+	pushConstant(code, value);
+}
+
+void VMCode::peephole(unsigned passes) {
+	vector<VMInstr> out;
+	vector<int> refs;	// jumps to each label name
+	bool changed = true, dead;
+	int value, len;
+
+	// each pass streams code into out and rewrites the tail of out as it grows
+	while (changed) {
+		changed = false;
+		dead = false;
+		refs.assign(names.size(), 0);
+		for (const VMInstr& in : code) {
+			if (in.op == OP_GOTO || in.op == OP_IF || in.op == OP_IFNOT)
+				refs[in.name]++;
+		}
+		out.clear();
+		out.reserve(code.size());
+		for (const VMInstr& in : code) {
+			if ((passes & PEEP_DEAD) && in.op == OP_LABEL && refs[in.name] == 0) {
+				changed = true;	// nothing jumps here, so it does not end a dead stretch either
+				continue;
+			}
+			if (in.op == OP_LABEL || in.op == OP_FUNCTION)
+				dead = false;
+			else if (dead) {	// unreachable: nothing jumps here without a label
+				changed = true;
+				continue;
+			}
+
+			if ((passes & PEEP_PUSHPOP) && in.op == OP_POP && !out.empty() && out.back().op == OP_PUSH &&
+				out.back().seg == in.seg && out.back().arg == in.arg) {
+				out.pop_back();
+				changed = true;
+				continue;
+			}
+			if ((passes & PEEP_CONST) && (in.op == OP_NEG || in.op == OP_NOT) && (len = constantTail(out, value)) > 0) {
+				value = (short)(in.op == OP_NEG ? -value : ~value);
+				if (constantLength(value) < len + 1) {
+					out.resize(out.size() - len);
+					pushConstant(out, value);
+					changed = true;
+					continue;
+				}
+			}
+			if ((passes & PEEP_CONST) && (in.op == OP_IF || in.op == OP_IFNOT) && (len = constantTail(out, value)) > 0) {
+				out.resize(out.size() - len);
+				if (in.op == OP_IF ? value != 0 : (short)value != -1) {	// always taken; if-not is "not; if-goto"
+					out.push_back(VMInstr{ OP_GOTO, SEG_NONE, 0, in.name });
+					dead = (passes & PEEP_DEAD) != 0;
+				}
+				changed = true;
+				continue;
+			}
+			if ((passes & PEEP_NOTIF) && !out.empty() && out.back().op == OP_NOT) {
+				if (in.op == OP_NOT) {
+					out.pop_back();
+					changed = true;
+					continue;
+				}
+				if (in.op == OP_IF || in.op == OP_IFNOT) {
+					out.back() = VMInstr{ (unsigned char)(in.op == OP_IF ? OP_IFNOT : OP_IF), SEG_NONE, 0, in.name };
+					changed = true;
+					continue;
+				}
+			}
+			if ((passes & PEEP_DEAD) && in.op == OP_LABEL && !out.empty() && out.back().op == OP_GOTO &&
+				out.back().name == in.name) {
+				out.pop_back();	// goto the very next line
+				changed = true;
+			}
+
+			out.push_back(in);
+			if ((passes & PEEP_DEAD) && (in.op == OP_GOTO || in.op == OP_RETURN))
+				dead = true;
+		}
+		code.swap(out);
+	}
+	bool again = false;
+	if (passes & PEEP_LOOPS) {	// each function is rewritten in its own buffer, then the class is rebuilt once
+		vector<VMInstr> out, fn;
+		out.reserve(code.size());
+		for (size_t from = 0, to; from < code.size(); from = to) {
+			for (to = from + 1; to < code.size() && code[to].op != OP_FUNCTION; to++)
+				;
+			fn.assign(code.begin() + from, code.begin() + to);
+			if (fn[0].op == OP_FUNCTION) {
+				again |= hoistLoops(fn);
+				again |= reuseInBlocks(fn);
+			}
+			out.insert(out.end(), fn.begin(), fn.end());
+		}
+		code.swap(out);
+	}
+	if (passes & PEEP_LOCALS) {	// after the loop pass, so its temporaries share slots too
+		for (size_t from = 0, to; from < code.size(); from = to) {
+			for (to = from + 1; to < code.size() && code[to].op != OP_FUNCTION; to++)
+				;
+			if (code[from].op == OP_FUNCTION)
+				again |= compactLocals(from, to);
+		}
+	}
+	if (again)	// shared slots turn some copies into "push X; pop X"
+		peephole(passes & ~(PEEP_LOOPS | PEEP_LOCALS));
+}
+
+int VMCode::idOf(string_view s) const {
+	unordered_map<string_view, int>::const_iterator it = ids.find(s);
+	return it == ids.end() ? -1 : it->second;
+}
+
+/* LOOP-INVARIANT AND REPEATED EXPRESSIONS */
+static const int IMPURE = 99;
+
+static int pureNet(const VMInstr& in, int mul, int div) {
+	// values a pure instruction pops less those it pushes; IMPURE if it has side effects or reads memory others write.
+	// temps count as pure: the compiler only uses them as scratch within one expression, which exprStarts checks
+	switch (in.op) {
+	case OP_PUSH:
+		return in.seg == SEG_THAT || (in.seg == SEG_POINTER && in.arg != 0) ? IMPURE : -1;
+	case OP_POP:
+		return in.seg == SEG_TEMP ? 1 : IMPURE;
+	case OP_NEG:
+	case OP_NOT:
+		return 0;
+	case OP_ADD:
+	case OP_SUB:
+	case OP_AND:
+	case OP_OR:
+	case OP_EQ:
+	case OP_GT:
+	case OP_LT:
+		return 1;
+	case OP_CALL:	// the OS's multiply and divide only compute
+		return in.arg == 2 && in.name >= 0 && (in.name == mul || in.name == div) ? 1 : IMPURE;
+	default:
+		return IMPURE;
+	}
+}
+
+static const size_t NONE = (size_t)-1;
+
+static vector<size_t> exprStarts(const vector<VMInstr>& fn, int mul, int div) {
+	/*
+	*	For each operator in the function fn, where the pure expression it finishes starts,
+	*	or NONE; in one pass, by running the stack with the start of each value on it. A
+	*	temp read stands for the value last popped into it, so "x * 3" takes x in with it.
+	*	An expression may not leave a temp that later code reads.
+	*/
+	size_t len = fn.size();
+	vector<size_t> starts(len, NONE), stack;
+	vector<int> depth(len + 1, 0);	// values pushed less values popped before each instruction
+	vector<unsigned char> live(len);	// temps read after each instruction before they are set again
+	size_t temps[8], lastPop[8];	// start of the value in each temp, latest pop into it
+	unsigned char read = 0;
+
+	for (size_t i = len; i-- > 0;) {
+		live[i] = read;
+		if (fn[i].seg == SEG_TEMP && fn[i].op == OP_PUSH)
+			read |= 1 << fn[i].arg;
+		else if (fn[i].seg == SEG_TEMP && fn[i].op == OP_POP)
+			read &= ~(1 << fn[i].arg);
+	}
+	fill(temps, temps + 8, NONE);
+	fill(lastPop, lastPop + 8, NONE);
+	for (size_t i = 0; i < len; i++) {
+		const VMInstr& in = fn[i];
+		int net = pureNet(in, mul, div);
+		depth[i + 1] = depth[i] - (net == IMPURE ? 0 : net);
+		if (net == IMPURE) {
+			stack.clear();
+			fill(temps, temps + 8, NONE);
+		}
+		else if (in.op == OP_PUSH)
+			stack.push_back(in.seg == SEG_TEMP ? temps[in.arg] : i);
+		else if (in.op == OP_POP) {
+			lastPop[in.arg] = i;
+			temps[in.arg] = stack.empty() ? NONE : stack.back();
+			if (!stack.empty())
+				stack.pop_back();
+		}
+		else {
+			size_t s = stack.size() < (size_t)net + 1 ? NONE : i;
+			for (int k = 0; k <= net && !stack.empty(); k++) {
+				s = stack.back() == NONE || s == NONE ? NONE : min(s, stack.back());
+				stack.pop_back();
+			}
+			stack.push_back(s);
+			if (s == NONE || depth[i + 1] - depth[s] != 1)
+				continue;
+			bool leaves = false;
+			for (int k = 0; live[i] && k < 8; k++)
+				leaves |= (live[i] >> k & 1) && lastPop[k] != NONE && lastPop[k] >= s;
+			if (!leaves)
+				starts[i] = s;
+		}
+	}
+	return starts;
+}
+
+static uint64_t instrKey(const VMInstr& in) {
+	// the fields the op uses, for telling copies of an expression apart
+	bool slot = in.op == OP_PUSH || in.op == OP_POP;
+	return (uint64_t)in.op << 40 | (uint64_t)(slot ? in.seg : 0) << 32 | (uint32_t)(slot ? in.arg : in.op == OP_CALL ? in.name : 0);
+}
+
+static bool isJump(const VMInstr& in) {
+	return in.op == OP_GOTO || in.op == OP_IF || in.op == OP_IFNOT;
+}
+
+static void collectWrites(const vector<VMInstr>& code, size_t from, size_t to, int mul, int div, unordered_set<int>& written, bool& calls) {
+	// the slots code[from, to) pops into; calls is set if it calls anything that may change statics or fields
+	for (size_t i = from; i < to; i++) {
+		if (code[i].op == OP_POP)	// any "that" may be a field of this
+			written.insert(code[i].seg << 16 | (code[i].seg == SEG_THAT ? 0 : code[i].arg));
+		else if (code[i].op == OP_CALL && pureNet(code[i], mul, div) == IMPURE)
+			calls = true;
+	}
+}
+
+static bool invariant(const VMInstr& in, const unordered_set<int>& written, bool calls) {
+	// a push whose value the code collectWrites looked at cannot change
+	if (in.op != OP_PUSH || in.seg == SEG_CONST || in.seg == SEG_TEMP)
+		return true;
+	if (written.count(in.seg << 16 | in.arg))
+		return false;
+	if ((in.seg == SEG_THIS || in.seg == SEG_POINTER) && written.count(SEG_POINTER << 16))
+		return false;	// this moved
+	if (in.seg == SEG_THIS && written.count(SEG_THAT << 16))
+		return false;
+	return !(calls && (in.seg == SEG_STATIC || in.seg == SEG_THIS));
+}
+
+bool VMCode::hoistLoops(vector<VMInstr>& fn) {
+	/*
+	*	A loop is a label with a jump back to it from further down; code only enters it by
+	*	falling into the label. Every pure expression in it whose operands nothing in the
+	*	loop writes is worked out once into a new local just above the label. Outer loops
+	*	come first and take what is invariant in them too; what is left to an inner loop
+	*	goes just above its label, still inside the outer one. A division may fail, so it
+	*	only moves if the loop would always have done it (before the first branch). All
+	*	loops are found on the code as it was and the function is rebuilt once.
+	*/
+	int mul = idOf("Math.multiply"), div = idOf("Math.divide");
+	size_t len = fn.size();
+	unordered_map<int, pair<size_t, size_t>> jumpsTo;	// label -> first and last jump to it
+	unordered_set<int> seen;
+	bool loops = false;
+	for (size_t i = 1; i < len; i++) {
+		if (fn[i].op == OP_LABEL)
+			seen.insert(fn[i].name);
+		else if (isJump(fn[i])) {
+			auto j = jumpsTo.emplace(fn[i].name, make_pair(i, i));
+			j.first->second.second = i;
+			loops |= seen.count(fn[i].name) != 0;
+		}
+	}
+	if (!loops)
+		return false;
+	vector<size_t> starts = exprStarts(fn, mul, div);	// labels and jumps end every expression
+	struct Pick { size_t s, e, label; int local; };
+	vector<Pick> picks;
+	vector<char> claimed(len, 0);
+	int locals = fn[0].arg;
+
+	for (size_t p = 1; p < len; p++) {
+		if (fn[p].op != OP_LABEL || !jumpsTo.count(fn[p].name))
+			continue;
+		pair<size_t, size_t> j = jumpsTo[fn[p].name];
+		size_t back = j.second;
+		if (back < p || j.first < p || fn[p - 1].op == OP_GOTO || fn[p - 1].op == OP_RETURN)
+			continue;	// not a loop, or one entered by a jump
+		bool outsideIn = false;	// a jump from outside to a label inside
+		for (size_t i = p + 1; i <= back && !outsideIn; i++) {
+			if (fn[i].op == OP_LABEL && jumpsTo.count(fn[i].name)) {
+				pair<size_t, size_t> k = jumpsTo[fn[i].name];
+				outsideIn = k.first < p || k.second > back;
+			}
+		}
+		if (outsideIn)
+			continue;
+		unordered_set<int> written;
+		bool calls = false;
+		collectWrites(fn, p, back + 1, mul, div, written, calls);
+		size_t branch = p + 1;
+		while (branch < back && !isJump(fn[branch]) && fn[branch].op != OP_LABEL)
+			branch++;
+		size_t base = p + 1;
+		vector<int> varies(1, 0), calling(1, 0), dividing(1, 0);	// counts before each instruction
+		for (size_t i = base; i < back; i++) {
+			varies.push_back(varies.back() + (!invariant(fn[i], written, calls) || claimed[i]));
+			calling.push_back(calling.back() + (fn[i].op == OP_CALL));
+			dividing.push_back(dividing.back() + (fn[i].op == OP_CALL && fn[i].name == div));
+		}
+
+		size_t mine = picks.size();	// [start, end) of each expression to hoist, outermost only
+		for (size_t e = base + 1; e <= back; e++) {
+			size_t s = starts[e - 1];
+			if (s == NONE || s < base || varies[e - base] != varies[s - base])
+				continue;	// already taken by an outer loop counts as varying
+			bool call = calling[e - base] != calling[s - base];
+			if ((e - s < 3 && !call) || (dividing[e - base] != dividing[s - base] && e > branch))
+				continue;	// a lone "push x; neg" is not worth a local
+			while (picks.size() > mine && picks.back().s >= s) {
+				picks.pop_back();	// inside this one
+				locals--;
+			}
+			picks.push_back(Pick{ s, e, p, locals++ });
+		}
+		for (size_t i = mine; i < picks.size(); i++)
+			fill(claimed.begin() + picks[i].s, claimed.begin() + picks[i].e, 1);
+	}
+	if (picks.empty())
+		return false;
+
+	// each label gets its loop's expressions in front; picks are in label order, then code order
+	vector<size_t> at(len, NONE);	// pick starting at each instruction
+	for (size_t i = 0; i < picks.size(); i++)
+		at[picks[i].s] = i;
+	vector<VMInstr> out;
+	out.reserve(len + 2 * picks.size());
+	for (size_t i = 0, k = 0; i < len;) {
+		for (; k < picks.size() && picks[k].label == i; k++) {
+			out.insert(out.end(), fn.begin() + picks[k].s, fn.begin() + picks[k].e);
+			out.push_back(VMInstr{ OP_POP, SEG_LOCAL, picks[k].local, -1 });
+		}
+		if (at[i] != NONE) {
+			out.push_back(VMInstr{ OP_PUSH, SEG_LOCAL, picks[at[i]].local, -1 });
+			i = picks[at[i]].e;
+		}
+		else
+			out.push_back(fn[i++]);
+	}
+	out[0].arg = locals;
+	fn.swap(out);
+	return true;
+}
+
+bool VMCode::reuseInBlocks(vector<VMInstr>& fn) {
+	/*
+	*	Within a basic block (no labels or jumps), the second and later copies of a pure
+	*	expression read the first one's value from a new local, as long as nothing between
+	*	them writes its operands. The first copy keeps its value on the stack and saves it:
+	*	"pop local t; push local t". Only expressions of four or more instructions (or with
+	*	a Math call) pay for that; bigger ones are matched first and win overlaps. Longer
+	*	than maxRepeat they are left alone, which keeps this linear on huge expressions.
+	*/
+	const size_t maxRepeat = 64;
+	int mul = idOf("Math.multiply"), div = idOf("Math.divide");
+	struct Cand { size_t block, s, e; uint64_t hash; };
+	size_t len = fn.size();
+	vector<size_t> endAt(len, 0);	// a copy starting here: its end, its local, whether it is the first
+	vector<int> localAt(len, 0);
+	vector<char> firstAt(len, 0), claimed(len, 0);
+	int locals = fn[0].arg;
+	vector<size_t> starts = exprStarts(fn, mul, div);	// labels and jumps already split them
+	vector<Cand> cands;
+
+	for (size_t b = 1, c; b < len; b = c + 1) {
+		for (c = b; c < len && !isJump(fn[c]) && fn[c].op != OP_LABEL && fn[c].op != OP_RETURN; c++)
+			;
+		size_t first = cands.size();
+		for (size_t e = b + 1; e <= c; e++) {
+			size_t s = starts[e - 1];
+			if (s == NONE || e - s > maxRepeat)
+				continue;
+			bool call = false;
+			uint64_t hash = 14695981039346656037ull;
+			for (size_t k = s; k < e; k++) {
+				call |= fn[k].op == OP_CALL;
+				hash = (hash ^ instrKey(fn[k])) * 1099511628211ull;
+			}
+			if (e - s >= 4 || call)
+				cands.push_back(Cand{ b, s, e, hash });
+		}
+		// copies of one expression in the block end up next to each other
+		sort(cands.begin() + first, cands.end(), [](const Cand& x, const Cand& y) {
+			return x.hash != y.hash ? x.hash < y.hash : x.s < y.s;
+		});
+	}
+	vector<pair<size_t, size_t>> groups;
+	for (size_t i = 0, j; i < cands.size(); i = j) {
+		for (j = i + 1; j < cands.size() && cands[j].block == cands[i].block && cands[j].hash == cands[i].hash; j++)
+			;
+		if (j - i >= 2)
+			groups.push_back(make_pair(i, j));
+	}
+	// longer expressions are served first
+	stable_sort(groups.begin(), groups.end(), [&](const pair<size_t, size_t>& x, const pair<size_t, size_t>& y) {
+		return cands[x.first].e - cands[x.first].s > cands[y.first].e - cands[y.first].s;
+	});
+	for (const pair<size_t, size_t>& g : groups) {
+		vector<const Cand*> use;
+		for (size_t i = g.first; i < g.second; i++) {
+			const Cand& o = cands[i];
+			bool free = true;
+			for (size_t k = o.s; k < o.e && free; k++)
+				free = !claimed[k];
+			if (!free || (!use.empty() && o.s < use.back()->e))
+				continue;
+			if (!use.empty()) {
+				const Cand& f = *use[0];
+				bool ok = o.e - o.s == f.e - f.s;
+				for (size_t k = 0; k < f.e - f.s && ok; k++)
+					ok = instrKey(fn[o.s + k]) == instrKey(fn[f.s + k]);	// not just the same hash
+				unordered_set<int> written;	// its operands must still hold what the first copy read
+				bool calls = false;
+				if (ok)
+					collectWrites(fn, f.e, o.s, mul, div, written, calls);
+				for (size_t k = o.s; k < o.e && ok; k++)
+					ok = invariant(fn[k], written, calls);
+				if (!ok)
+					continue;
+			}
+			use.push_back(&o);
+		}
+		if (use.size() < 2)
+			continue;
+		for (size_t i = 0; i < use.size(); i++) {
+			fill(claimed.begin() + use[i]->s, claimed.begin() + use[i]->e, 1);
+			endAt[use[i]->s] = use[i]->e;
+			localAt[use[i]->s] = locals;
+			firstAt[use[i]->s] = i == 0;
+		}
+		locals++;
+	}
+	if (locals == fn[0].arg)
+		return false;
+
+	vector<VMInstr> out;
+	out.reserve(len);
+	for (size_t i = 0; i < len;) {
+		if (!endAt[i])
+			out.push_back(fn[i++]);
+		else if (firstAt[i]) {
+			out.insert(out.end(), fn.begin() + i, fn.begin() + endAt[i]);
+			out.push_back(VMInstr{ OP_POP, SEG_LOCAL, localAt[i], -1 });
+			out.push_back(VMInstr{ OP_PUSH, SEG_LOCAL, localAt[i], -1 });
+			i = endAt[i];
+		}
+		else {
+			out.push_back(VMInstr{ OP_PUSH, SEG_LOCAL, localAt[i], -1 });
+			i = endAt[i];
+		}
+	}
+	out[0].arg = locals;
+	fn.swap(out);
+	return true;
+}
+
+bool VMCode::compactLocals(size_t from, size_t to) {
+	/*
+	*	Backward liveness over the local slots, then greedy coloring of the slots that
+	*	interfere: two slots conflict when one is written while the other is still going
+	*	to be read, or when both are read before any write (they then rely on the zero
+	*	every local starts with). Colors are handed out in order of first use.
+	*/
+	int n = code[from].arg;
+	if (n < 2)
+		return false;
+	size_t words = (n + 63) / 64, len = to - from;
+	vector<uint64_t> live((len + 1) * words, 0);	// live-in of each instruction; row len is "after the end"
+	vector<uint64_t> next(words);
+	vector<char> conflict((size_t)n * n, 0);
+	vector<int> color(n, -1), order;
+	unordered_map<int, size_t> labels;	// label name -> its instruction
+	bool changed = true;
+
+	for (size_t i = from; i < to; i++) {
+		if (code[i].op == OP_LABEL)
+			labels[code[i].name] = i - from;
+	}
+	// the successors of i are i + 1 unless it jumps or returns, plus the label of a jump
+	while (changed) {
+		changed = false;
+		for (size_t i = len; i-- > 0;) {
+			const VMInstr& in = code[from + i];
+			uint64_t* row = &live[i * words];
+			fill(next.begin(), next.end(), 0);
+			if (in.op != OP_GOTO && in.op != OP_RETURN) {
+				for (size_t w = 0; w < words; w++)
+					next[w] |= live[(i + 1) * words + w];
+			}
+			if (in.op == OP_GOTO || in.op == OP_IF || in.op == OP_IFNOT) {
+				size_t target = labels.count(in.name) ? labels[in.name] : len;
+				for (size_t w = 0; w < words; w++)
+					next[w] |= live[target * words + w];
+			}
+			if (in.seg == SEG_LOCAL && in.arg < n) {
+				if (in.op == OP_POP)
+					next[in.arg / 64] &= ~(1ull << (in.arg % 64));
+				else if (in.op == OP_PUSH)
+					next[in.arg / 64] |= 1ull << (in.arg % 64);
+			}
+			for (size_t w = 0; w < words; w++) {
+				if (row[w] != next[w]) {
+					row[w] = next[w];
+					changed = true;
+				}
+			}
+		}
+	}
+	auto isLive = [&](size_t i, int v) { return (live[i * words + v / 64] >> (v % 64)) & 1; };
+	for (size_t i = 0; i < len; i++) {
+		const VMInstr& in = code[from + i];
+		if (in.seg != SEG_LOCAL || in.arg >= n || (in.op != OP_PUSH && in.op != OP_POP))
+			continue;
+		if (color[in.arg] == -1) {
+			color[in.arg] = -2;	// seen
+			order.push_back(in.arg);
+		}
+		if (in.op == OP_POP) {
+			for (int v = 0; v < n; v++) {
+				if (v != in.arg && isLive(i + 1, v))
+					conflict[(size_t)in.arg * n + v] = conflict[(size_t)v * n + in.arg] = 1;
+			}
+		}
+	}
+	for (int a = 0; a < n; a++) {
+		for (int b = a + 1; b < n && isLive(0, a); b++) {
+			if (isLive(0, b))
+				conflict[(size_t)a * n + b] = conflict[(size_t)b * n + a] = 1;
+		}
+	}
+	int used = 0;
+	for (int v : order) {
+		vector<char> taken(used + 1, 0);
+		for (int u : order) {
+			if (color[u] >= 0 && conflict[(size_t)v * n + u])
+				taken[color[u]] = 1;
+		}
+		int c = 0;
+		while (taken[c])
+			c++;
+		color[v] = c;
+		used = max(used, c + 1);
+	}
+	if (used >= n)
+		return false;
+	for (size_t i = from + 1; i < to; i++) {
+		if (code[i].seg == SEG_LOCAL && code[i].arg < n && (code[i].op == OP_PUSH || code[i].op == OP_POP))
+			code[i].arg = color[code[i].arg];
+	}
+	code[from].arg = used;
+	return true;
+}
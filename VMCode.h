@@ -0,0 +1,124 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+enum VMOP {
+	OP_PUSH,
+	OP_POP,
+	OP_ADD,
+	OP_SUB,
+	OP_NEG,
+	OP_EQ,
+	OP_GT,
+	OP_LT,
+	OP_AND,
+	OP_OR,
+	OP_NOT,
+	OP_LABEL,
+	OP_GOTO,
+	OP_IF,
+	OP_IFNOT,	// fused "not; if-goto": jumps unless the value is -1 (true); only made by the peephole pass, printed as the two original lines
+	OP_CALL,
+	OP_FUNCTION,
+	OP_RETURN
+};
+
+enum SEGMENT {
+	SEG_CONST,
+	SEG_ARG,
+	SEG_LOCAL,
+	SEG_STATIC,
+	SEG_THIS,
+	SEG_THAT,
+	SEG_POINTER,
+	SEG_TEMP,
+	SEG_NONE
+};
+
+enum PEEPHOLE {	// passes for VMCode::peephole(), or'd together
+	PEEP_PUSHPOP = 1,	// drop "push X; pop X"
+	PEEP_CONST = 2,	// fold constants followed by neg/not, and if-goto on a constant
+	PEEP_NOTIF = 4,	// "not; if-goto" -> if-not-goto, "not; not" -> nothing
+	PEEP_DEAD = 8,	// drop code after return/goto up to the next label, gotos to the next line and unused labels
+	PEEP_LOCALS = 16,	// give locals whose lifetimes never overlap the same slot, so functions need fewer
+	PEEP_LOOPS = 32,	// compute loop-invariant pure expressions once before the loop, and repeats within a block once
+	PEEP_ALL = 63
+};
+
+struct VMInstr {
+	unsigned char op;	// VMOP
+	unsigned char seg;	// SEGMENT of push/pop
+	int arg;	// push/pop index, nArgs of call, nLocals of function
+	int name;	// label or function name in VMCode::names; -1 if none
+};
+
+/*
+*	.vmb: a VMCode laid out so a loader can map the file and use it where it lies.
+*	Little-endian, fixed-width records, every section 4-byte aligned; offsets are bytes
+*	from the start of the file. VMBHeader, then the code, the function index, the name
+*	index and the NUL-terminated name bytes the index points into.
+*/
+struct VMBHeader {
+	char magic[4];	// "VMB1"
+	uint32_t size;	// of the whole file, so truncation shows
+	uint32_t instructions;
+	uint32_t functions;
+	uint32_t names;
+	uint32_t code;	// section offsets
+	uint32_t functionIndex;
+	uint32_t nameIndex;
+	uint32_t strings;
+};
+
+struct VMBInstr {	// VMInstr in 8 bytes
+	uint8_t op;	// VMOP
+	uint8_t seg;	// SEGMENT
+	uint16_t arg;
+	int32_t name;	// into the name index, -1 if none
+};
+
+struct VMBFunction {
+	uint32_t name;
+	uint32_t entry;	// instruction holding its function command
+};
+
+struct VMBName {
+	uint32_t offset;	// into the strings section
+	uint32_t length;	// not counting the NUL
+};
+
+class VMCode {
+	/* A VM program held in memory: a vector of typed instructions plus an
+	interned table of the label and function names they refer to.
+	*/
+	std::deque<std::string> names;	// deque so the views in ids stay valid as it grows
+	std::unordered_map<std::string_view, int> ids;
+	bool compactLocals(size_t from, size_t to);	// PEEP_LOCALS on the function in code[from, to); true if it shrank
+	bool hoistLoops(std::vector<VMInstr>& fn);	// PEEP_LOOPS, loop part, on one function; true if anything moved
+	bool reuseInBlocks(std::vector<VMInstr>& fn);	// PEEP_LOOPS, basic block part
+	int idOf(std::string_view s) const;	// id of a name already interned, -1 if none
+public:
+	std::vector<VMInstr> code;
+	VMCode() = default;
+	VMCode(const VMCode&) = delete;	// the copied ids would still view the other's names; append() copies properly
+	VMCode& operator=(const VMCode&) = delete;
+	VMCode(VMCode&&) = default;	// a moved deque keeps its strings where they were, so the views stay good
+	VMCode& operator=(VMCode&&) = default;
+	int name(std::string_view s);	// interns a label/function name
+	std::string_view nameOf(int id) const;
+	void emit(VMOP op, SEGMENT seg = SEG_NONE, int arg = 0, int name = -1);
+	bool isConstant(size_t from, size_t to, int& value);	// code[from, to) pushes one constant ("push constant c" + neg/not)
+	void emitConstant(int value);	// shortest push of a 16-bit value
+	void append(const VMCode& other);	// appends other's instructions, interning their names here (a plain copy would share other's name views)
+	void peephole(unsigned passes = PEEP_ALL);	// rewrites code in place until nothing changes
+	void print(std::string& out) const;	// appends the program as .vm text
+	void parse(std::string_view text);	// appends the instructions of .vm text; throws on a line it cannot read
+	void writeBinary(std::string& out) const;	// appends the program as .vmb
+	void readBinary(std::string_view data);	// appends the instructions of a .vmb image; throws if it is not a sound one
+	static bool isBinary(std::string_view data);	// starts with the .vmb magic?
+	void clear();
+};
@@ -0,0 +1,474 @@
+#include "VMEmulator.h"
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+#if defined(__GNUC__) || defined(__clang__)
+#define VM_COMPUTED_GOTO	// labels as values: each handler jumps straight to the next one
+#endif
+
+enum {	// decoded instructions: one per VM command and segment
+	I_PUSH_CONST,
+	I_PUSH_LOCAL,
+	I_PUSH_ARG,
+	I_PUSH_THIS,
+	I_PUSH_THAT,
+	I_PUSH_RAM,	// static, pointer, temp: a is the address
+	I_POP_LOCAL,
+	I_POP_ARG,
+	I_POP_THIS,
+	I_POP_THAT,
+	I_POP_RAM,
+	I_ADD,
+	I_SUB,
+	I_NEG,
+	I_EQ,
+	I_GT,
+	I_LT,
+	I_AND,
+	I_OR,
+	I_NOT,
+	I_GOTO,
+	I_IF,
+	I_IFNOT,
+	I_CALL,	// a = function entry once linked
+	I_NATIVE,	// a = NATIVE id
+	I_FUNCTION,
+	I_RETURN,
+	I_HALT
+};
+
+enum { SP, LCL, ARG, THIS, THAT };
+
+static const int STACK_END = 2048;	// stack is 256..2047, heap 2048..16383 as on the Hack platform
+static const int HEAP_END = 16384;
+static const int RAM_SIZE = 32768;
+
+enum NATIVE {
+	N_MATH_INIT, N_MATH_ABS, N_MATH_MULTIPLY, N_MATH_DIVIDE, N_MATH_MIN, N_MATH_MAX, N_MATH_SQRT,
+	N_STRING_NEW, N_STRING_DISPOSE, N_STRING_LENGTH, N_STRING_CHARAT, N_STRING_SETCHARAT, N_STRING_APPENDCHAR,
+	N_STRING_ERASELASTCHAR, N_STRING_INTVALUE, N_STRING_SETINT, N_STRING_BACKSPACE, N_STRING_DOUBLEQUOTE, N_STRING_NEWLINE,
+	N_ARRAY_NEW, N_ARRAY_DISPOSE,
+	N_MEMORY_INIT, N_MEMORY_PEEK, N_MEMORY_POKE, N_MEMORY_ALLOC, N_MEMORY_DEALLOC,
+	N_OUTPUT_INIT, N_OUTPUT_MOVECURSOR, N_OUTPUT_PRINTCHAR, N_OUTPUT_PRINTSTRING, N_OUTPUT_PRINTINT, N_OUTPUT_PRINTLN, N_OUTPUT_BACKSPACE,
+	N_SYS_HALT, N_SYS_ERROR, N_SYS_WAIT,
+	N_COUNT
+};
+
+static const struct {
+	const char* name;
+	int nArgs;
+} natives[N_COUNT] = {
+	{ "Math.init", 0 }, { "Math.abs", 1 }, { "Math.multiply", 2 }, { "Math.divide", 2 }, { "Math.min", 2 }, { "Math.max", 2 }, { "Math.sqrt", 1 },
+	{ "String.new", 1 }, { "String.dispose", 1 }, { "String.length", 1 }, { "String.charAt", 2 }, { "String.setCharAt", 3 }, { "String.appendChar", 2 },
+	{ "String.eraseLastChar", 1 }, { "String.intValue", 1 }, { "String.setInt", 2 }, { "String.backSpace", 0 }, { "String.doubleQuote", 0 }, { "String.newLine", 0 },
+	{ "Array.new", 1 }, { "Array.dispose", 1 },
+	{ "Memory.init", 0 }, { "Memory.peek", 1 }, { "Memory.poke", 2 }, { "Memory.alloc", 1 }, { "Memory.deAlloc", 1 },
+	{ "Output.init", 0 }, { "Output.moveCursor", 2 }, { "Output.printChar", 1 }, { "Output.printString", 1 }, { "Output.printInt", 1 }, { "Output.println", 0 }, { "Output.backSpace", 0 },
+	{ "Sys.halt", 0 }, { "Sys.error", 1 }, { "Sys.wait", 1 }
+};
+
+/* VM EMULATOR FUNCTIONS */
+VMEmulator::VMEmulator() {
+	heapTop = STACK_END;
+	linked = false;
+	steps = 0;
+	memset(ram, 0, sizeof ram);
+}
+
+int VMEmulator::function(string_view name) {
+	unordered_map<string, int>::iterator it = functionIds.find(string(name));
+	if (it != functionIds.end())
+		return it->second;
+	functions.push_back(Function{ string(name), -1, -1 });
+	functionIds.emplace(string(name), (int)functions.size() - 1);
+	return (int)functions.size() - 1;
+}
+
+int VMEmulator::staticAddress(string_view fileName, int index) {
+	string key = string(fileName) + '.' + to_string(index);
+	unordered_map<string, int>::iterator it = statics.find(key);
+	if (it != statics.end())
+		return it->second;
+	if (16 + statics.size() > 255)
+		throw runtime_error("more than 240 static variables");
+	return statics.emplace(key, 16 + (int)statics.size()).first->second;
+}
+
+int16_t VMEmulator::peek(int address) {
+	return ram[address & 0x7FFF];
+}
+
+void VMEmulator::load(const VMCode& code, string_view fileName) {
+	unordered_map<int, int> labels;	// label name -> instruction, within the current function
+	vector<pair<int, int>> jumps;	// (instruction, label name) waiting for the end of the function
+	int f, start = -1;
+	int rise = 0, reach = 0;	// stack growth since the last check, and its most over the function
+
+	// jumps only reach labels of their own function; they and the function entry check the stack
+	// has room for the most the function pushes before it gets to another check
+	auto resolve = [&]() {
+		for (const pair<int, int>& j : jumps) {
+			unordered_map<int, int>::iterator it = labels.find(j.second);
+			if (it == labels.end())
+				throw runtime_error(string(fileName) + ": no label " + string(code.nameOf(j.second)));
+			prog[j.first].a = it->second;
+			prog[j.first].b = reach;
+		}
+		if (start >= 0)
+			prog[start].b = reach;
+		labels.clear();
+		jumps.clear();
+		rise = reach = 0;
+	};
+	for (const VMInstr& in : code.code) {
+		Instr out = { nullptr, I_HALT, in.arg, 0 };
+		switch (in.op) {
+		case OP_PUSH: rise++; break;
+		case OP_CALL: reach = max(reach, rise + 5); rise += 1 - in.arg; break;	// the frame goes above the arguments
+		case OP_FUNCTION:
+		case OP_NEG:
+		case OP_NOT:
+		case OP_LABEL: break;	// a jump here was checked for the whole function
+		case OP_GOTO:
+		case OP_RETURN: rise = 0; break;
+		default: rise = in.op == OP_IF || in.op == OP_IFNOT ? 0 : rise - 1; break;	// pop, binary ops
+		}
+		reach = max(reach, rise);
+		switch (in.op) {
+		case OP_PUSH:
+		case OP_POP:
+			switch (in.seg) {
+			case SEG_CONST: out.op = I_PUSH_CONST; break;
+			case SEG_LOCAL: out.op = I_PUSH_LOCAL; break;
+			case SEG_ARG: out.op = I_PUSH_ARG; break;
+			case SEG_THIS: out.op = I_PUSH_THIS; break;
+			case SEG_THAT: out.op = I_PUSH_THAT; break;
+			case SEG_STATIC: out.op = I_PUSH_RAM; out.a = staticAddress(fileName, in.arg); break;
+			case SEG_POINTER: out.op = I_PUSH_RAM; out.a = THIS + in.arg; break;
+			case SEG_TEMP: out.op = I_PUSH_RAM; out.a = 5 + in.arg; break;
+			}
+			if ((in.seg == SEG_POINTER && (unsigned)in.arg > 1) || (in.seg == SEG_TEMP && (unsigned)in.arg > 7) ||
+				(in.op == OP_POP && in.seg == SEG_CONST))
+				throw runtime_error(string(fileName) + ": bad segment index");
+			if (in.op == OP_POP)
+				out.op += I_POP_LOCAL - I_PUSH_LOCAL;
+			break;
+		case OP_ADD: out.op = I_ADD; break;
+		case OP_SUB: out.op = I_SUB; break;
+		case OP_NEG: out.op = I_NEG; break;
+		case OP_EQ: out.op = I_EQ; break;
+		case OP_GT: out.op = I_GT; break;
+		case OP_LT: out.op = I_LT; break;
+		case OP_AND: out.op = I_AND; break;
+		case OP_OR: out.op = I_OR; break;
+		case OP_NOT: out.op = I_NOT; break;
+		case OP_LABEL:
+			labels[in.name] = (int)prog.size();
+			continue;	// nothing to execute
+		case OP_GOTO:
+		case OP_IF:
+		case OP_IFNOT:
+			out.op = in.op == OP_GOTO ? I_GOTO : in.op == OP_IF ? I_IF : I_IFNOT;
+			jumps.push_back(make_pair((int)prog.size(), in.name));
+			break;
+		case OP_CALL:
+			out.op = I_CALL;
+			out.a = function(code.nameOf(in.name));
+			out.b = in.arg;
+			break;
+		case OP_FUNCTION:
+			resolve();
+			f = function(code.nameOf(in.name));
+			if (functions[f].entry >= 0)
+				throw runtime_error(string(fileName) + ": " + functions[f].name + " is defined twice");
+			functions[f].entry = (int)prog.size();
+			start = (int)prog.size();
+			rise = reach = in.arg;	// the locals
+			out.op = I_FUNCTION;
+			break;
+		case OP_RETURN: out.op = I_RETURN; break;
+		}
+		prog.push_back(out);
+	}
+	resolve();
+	linked = false;
+}
+
+void VMEmulator::link() {
+	for (Function& f : functions) {
+		if (f.entry >= 0 && f.name != "Sys.halt")	// an OS Sys.halt just spins; stopping is what it means
+			continue;
+		for (int n = 0; n < N_COUNT; n++) {
+			if (f.name == natives[n].name)
+				f.native = n;
+		}
+		if (f.native < 0)
+			throw runtime_error("no function " + f.name);
+	}
+	for (Instr& in : prog) {
+		if (in.op != I_CALL)
+			continue;
+		const Function& f = functions[in.a];
+		if (f.native < 0)
+			in.a = f.entry;
+		else if (in.b != natives[f.native].nArgs)
+			throw runtime_error(f.name + " takes " + to_string(natives[f.native].nArgs) + " arguments");
+		else {
+			in.op = I_NATIVE;
+			in.a = f.native;
+		}
+	}
+	prog.push_back(Instr{ nullptr, I_HALT, 0, 0 });	// where the entry function returns to
+	linked = true;
+}
+
+int VMEmulator::alloc(int n) {
+	int a;
+	if (n <= 0)
+		n = 1;
+	unordered_map<int, vector<int>>::iterator it = freeBlocks.find(n);
+	if (it != freeBlocks.end() && !it->second.empty()) {
+		a = it->second.back();
+		it->second.pop_back();
+		return a;
+	}
+	if (heapTop + n + 1 > HEAP_END)
+		throw runtime_error("Memory.alloc: heap overflow");
+	ram[heapTop] = (int16_t)n;	// size word in front of the block, for deAlloc
+	a = heapTop + 1;
+	heapTop += n + 1;
+	return a;
+}
+
+int16_t VMEmulator::callNative(int id, int16_t* args, ostream& out, bool& halt) {
+	int s = (uint16_t)args[0] & 0x7FFF, n;	// this of the String methods
+	string digits;
+	auto at = [this](int i) -> int16_t& {	// objects come from the program, so keep every access inside RAM
+		return ram[i & 0x7FFF];
+	};
+	switch (id) {
+	case N_MATH_ABS: return (int16_t)(args[0] < 0 ? -args[0] : args[0]);
+	case N_MATH_MULTIPLY: return (int16_t)(args[0] * args[1]);
+	case N_MATH_DIVIDE:
+		if (args[1] == 0)
+			throw runtime_error("Math.divide: division by zero");
+		return (int16_t)(args[0] / args[1]);
+	case N_MATH_MIN: return args[0] < args[1] ? args[0] : args[1];
+	case N_MATH_MAX: return args[0] > args[1] ? args[0] : args[1];
+	case N_MATH_SQRT:
+		if (args[0] < 0)
+			throw runtime_error("Math.sqrt: negative argument");
+		for (n = 0; (n + 1) * (n + 1) <= args[0]; n++)
+			;
+		return (int16_t)n;
+	// String: capacity, length, then the characters
+	case N_STRING_NEW:
+		if (args[0] < 0)
+			throw runtime_error("String.new: negative length");
+		n = alloc(args[0] + 2);
+		at(n) = args[0];
+		at(n + 1) = 0;
+		return (int16_t)n;
+	case N_STRING_LENGTH: return at(s + 1);
+	case N_STRING_CHARAT:
+	case N_STRING_SETCHARAT:
+		if (args[1] < 0 || args[1] >= at(s + 1))
+			throw runtime_error(string(natives[id].name) + ": index out of range");
+		if (id == N_STRING_CHARAT)
+			return at(s + 2 + args[1]);
+		at(s + 2 + args[1]) = args[2];
+		return 0;
+	case N_STRING_APPENDCHAR:
+		if (at(s + 1) >= at(s))
+			throw runtime_error("String.appendChar: string is full");
+		at(s + 2 + at(s + 1)++) = args[1];
+		return args[0];
+	case N_STRING_ERASELASTCHAR:
+		if (at(s + 1) > 0)
+			at(s + 1)--;
+		return 0;
+	case N_STRING_INTVALUE:
+		n = 0;
+		for (int i = at(s + 1) > 0 && at(s + 2) == '-' ? 1 : 0; i < at(s + 1) && at(s + 2 + i) >= '0' && at(s + 2 + i) <= '9'; i++)
+			n = n * 10 + (at(s + 2 + i) - '0');
+		return (int16_t)(at(s + 1) > 0 && at(s + 2) == '-' ? -n : n);
+	case N_STRING_SETINT:
+		digits = to_string(args[1]);
+		if ((int)digits.size() > at(s))
+			throw runtime_error("String.setInt: string is too short");
+		for (size_t i = 0; i < digits.size(); i++)
+			at(s + 2 + i) = digits[i];
+		at(s + 1) = (int16_t)digits.size();
+		return 0;
+	case N_STRING_BACKSPACE: return 129;
+	case N_STRING_DOUBLEQUOTE: return '"';
+	case N_STRING_NEWLINE: return 128;
+	case N_ARRAY_NEW:
+	case N_MEMORY_ALLOC: return (int16_t)alloc(args[0]);
+	case N_STRING_DISPOSE:
+	case N_ARRAY_DISPOSE:
+	case N_MEMORY_DEALLOC:
+		if (s > STACK_END && s < heapTop)
+			freeBlocks[at(s - 1)].push_back(s);
+		return 0;
+	case N_MEMORY_PEEK: return at(s);
+	case N_MEMORY_POKE:
+		at(s) = args[1];
+		return 0;
+	// Output goes to a text stream: 128 is newline, 129 backspace
+	case N_OUTPUT_PRINTCHAR:
+		out.put(args[0] == 128 ? '\n' : args[0] == 129 ? '\b' : (char)args[0]);
+		return 0;
+	case N_OUTPUT_PRINTSTRING:
+		for (int i = 0; i < at(s + 1); i++)
+			out.put(at(s + 2 + i) == 128 ? '\n' : (char)at(s + 2 + i));
+		return 0;
+	case N_OUTPUT_PRINTINT:
+		out << args[0];
+		return 0;
+	case N_OUTPUT_PRINTLN:
+		out.put('\n');
+		return 0;
+	case N_OUTPUT_BACKSPACE:
+		out.put('\b');
+		return 0;
+	case N_SYS_HALT:
+		halt = true;
+		return 0;
+	case N_SYS_ERROR: throw runtime_error("Sys.error " + to_string(args[0]));
+	default: return 0;	// init functions, moveCursor, wait
+	}
+}
+
+int16_t VMEmulator::run(ostream& out, string_view entry, long long maxSteps) {
+	const Instr* ip;
+	const Instr* in;
+	int sp, frame, f;
+	long long n = 0;
+	bool halt = false;
+
+	if (!linked)
+		link();
+	if (entry.empty())
+		entry = functionIds.count("Sys.init") && functions[functionIds["Sys.init"]].entry >= 0 ? "Sys.init" : "Main.main";
+	f = functionIds.count(string(entry)) ? functionIds[string(entry)] : -1;
+	if (f < 0 || functions[f].entry < 0)
+		throw runtime_error("no function " + string(entry));
+
+	// fresh machine, then a call frame that returns onto the final halt
+	memset(ram, 0, sizeof ram);
+	freeBlocks.clear();
+	returns.clear();
+	heapTop = STACK_END;
+	sp = 256;
+	sp += 5;
+	ram[ARG] = (int16_t)(sp - 5);
+	ram[LCL] = (int16_t)sp;
+	returns.push_back((int)prog.size() - 1);
+	ip = &prog[functions[f].entry];
+
+#ifdef VM_COMPUTED_GOTO
+	static const void* handlers[] = {
+		&&L_I_PUSH_CONST, &&L_I_PUSH_LOCAL, &&L_I_PUSH_ARG, &&L_I_PUSH_THIS, &&L_I_PUSH_THAT, &&L_I_PUSH_RAM,
+		&&L_I_POP_LOCAL, &&L_I_POP_ARG, &&L_I_POP_THIS, &&L_I_POP_THAT, &&L_I_POP_RAM,
+		&&L_I_ADD, &&L_I_SUB, &&L_I_NEG, &&L_I_EQ, &&L_I_GT, &&L_I_LT, &&L_I_AND, &&L_I_OR, &&L_I_NOT,
+		&&L_I_GOTO, &&L_I_IF, &&L_I_IFNOT, &&L_I_CALL, &&L_I_NATIVE, &&L_I_FUNCTION, &&L_I_RETURN, &&L_I_HALT
+	};
+	for (Instr& i : prog)
+		i.go = handlers[i.op];
+#define HANDLER(x) L_##x:
+#define DISPATCH() do { in = ip++; n++; goto *in->go; } while (0)
+	DISPATCH();
+#else
+#define HANDLER(x) case x:
+#define DISPATCH() continue
+	for (;;) {
+		in = ip++;
+		n++;
+		switch (in->op) {
+#endif
+// segment slot through a base pointer; masked so a bad pointer cannot leave RAM
+#define SLOT(base) ram[((uint16_t)ram[base] + in->a) & 0x7FFF]
+// every loop goes through a jump and every recursion through a function, so checking there bounds both;
+// b of a jump or function is how far the stack can grow before the next check, which keeps it inside RAM
+#define CHECK() if ((maxSteps >= 0 && n > maxSteps) || sp >= STACK_END || sp + in->b >= RAM_SIZE) goto limit
+
+	HANDLER(I_PUSH_CONST) ram[sp++] = (int16_t)in->a; DISPATCH();
+	HANDLER(I_PUSH_LOCAL) ram[sp++] = SLOT(LCL); DISPATCH();
+	HANDLER(I_PUSH_ARG) ram[sp++] = SLOT(ARG); DISPATCH();
+	HANDLER(I_PUSH_THIS) ram[sp++] = SLOT(THIS); DISPATCH();
+	HANDLER(I_PUSH_THAT) ram[sp++] = SLOT(THAT); DISPATCH();
+	HANDLER(I_PUSH_RAM) ram[sp++] = ram[in->a]; DISPATCH();
+	HANDLER(I_POP_LOCAL) SLOT(LCL) = ram[--sp]; DISPATCH();
+	HANDLER(I_POP_ARG) SLOT(ARG) = ram[--sp]; DISPATCH();
+	HANDLER(I_POP_THIS) SLOT(THIS) = ram[--sp]; DISPATCH();
+	HANDLER(I_POP_THAT) SLOT(THAT) = ram[--sp]; DISPATCH();
+	HANDLER(I_POP_RAM) ram[in->a] = ram[--sp]; DISPATCH();
+	HANDLER(I_ADD) sp--; ram[sp - 1] = (int16_t)(ram[sp - 1] + ram[sp]); DISPATCH();
+	HANDLER(I_SUB) sp--; ram[sp - 1] = (int16_t)(ram[sp - 1] - ram[sp]); DISPATCH();
+	HANDLER(I_NEG) ram[sp - 1] = (int16_t)-ram[sp - 1]; DISPATCH();
+	HANDLER(I_EQ) sp--; ram[sp - 1] = ram[sp - 1] == ram[sp] ? -1 : 0; DISPATCH();
+	HANDLER(I_GT) sp--; ram[sp - 1] = ram[sp - 1] > ram[sp] ? -1 : 0; DISPATCH();
+	HANDLER(I_LT) sp--; ram[sp - 1] = ram[sp - 1] < ram[sp] ? -1 : 0; DISPATCH();
+	HANDLER(I_AND) sp--; ram[sp - 1] &= ram[sp]; DISPATCH();
+	HANDLER(I_OR) sp--; ram[sp - 1] |= ram[sp]; DISPATCH();
+	HANDLER(I_NOT) ram[sp - 1] = (int16_t)~ram[sp - 1]; DISPATCH();
+	HANDLER(I_GOTO) CHECK(); ip = &prog[in->a]; DISPATCH();
+	HANDLER(I_IF) CHECK(); if (ram[--sp]) ip = &prog[in->a]; DISPATCH();
+	HANDLER(I_IFNOT) CHECK(); if (ram[--sp] != -1) ip = &prog[in->a]; DISPATCH();
+	HANDLER(I_CALL)
+		// return address (kept whole in returns), LCL, ARG, THIS, THAT
+		returns.push_back((int)(ip - prog.data()));
+		ram[sp] = (int16_t)returns.back();
+		ram[sp + 1] = ram[LCL];
+		ram[sp + 2] = ram[ARG];
+		ram[sp + 3] = ram[THIS];
+		ram[sp + 4] = ram[THAT];
+		sp += 5;
+		ram[ARG] = (int16_t)(sp - 5 - in->b);
+		ram[LCL] = (int16_t)sp;
+		ip = &prog[in->a];
+		DISPATCH();
+	HANDLER(I_NATIVE)
+		ram[SP] = (int16_t)sp;
+		ram[sp - in->b] = callNative(in->a, &ram[sp - in->b], out, halt);
+		sp += 1 - in->b;
+		if (halt)
+			goto done;
+		DISPATCH();
+	HANDLER(I_FUNCTION)
+		CHECK();
+		for (int i = 0; i < in->a; i++)
+			ram[sp++] = 0;
+		DISPATCH();
+	HANDLER(I_RETURN)
+		frame = (uint16_t)ram[LCL];
+		ram[(uint16_t)ram[ARG] & 0x7FFF] = ram[sp - 1];
+		sp = (uint16_t)ram[ARG] + 1;
+		ram[THAT] = ram[frame - 1];
+		ram[THIS] = ram[frame - 2];
+		ram[ARG] = ram[frame - 3];
+		ram[LCL] = ram[frame - 4];
+		ip = &prog[returns.back()];
+		returns.pop_back();
+		DISPATCH();
+	HANDLER(I_HALT)
+		goto done;
+#ifndef VM_COMPUTED_GOTO
+		}
+	}
+#endif
+#undef HANDLER
+#undef DISPATCH
+#undef SLOT
+#undef CHECK
+limit:
+	steps = n;
+	throw runtime_error(sp >= STACK_END || sp + in->b >= RAM_SIZE ? "stack overflow" : "step limit reached");
+done:
+	steps = n;
+	ram[SP] = (int16_t)sp;
+	return ram[sp - 1];
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "VMCode.h"
+
+class VMEmulator {
+	/* Runs VM programs in process. load() decodes each class into one flat array of
+	specialized instructions (push local 2, call #17, ...) with labels and calls already
+	resolved to indexes, and run() walks it with a computed-goto loop (a switch where
+	the compiler has no labels-as-values). RAM, the stack and the frames are laid out
+	as on the Hack platform; the OS classes are native functions, used for every OS
+	subroutine the program does not define itself. Screen and Keyboard are not there.
+	*/
+	struct Instr {
+		const void* go;	// handler of op, filled in by run()
+		int op;	// decoded opcode
+		int a;	// constant, slot, RAM address, jump target or function index
+		int b;	// nArgs of a call
+	};
+	struct Function {
+		std::string name;
+		int entry;	// first instruction, -1 until loaded
+		int native;	// OS stand-in used when it is never loaded, -1 if none
+	};
+	std::vector<Instr> prog;
+	std::vector<Function> functions;
+	std::unordered_map<std::string, int> functionIds;
+	std::unordered_map<std::string, int> statics;	// "Xxx.i" -> RAM address
+	std::unordered_map<int, std::vector<int>> freeBlocks;	// heap blocks by size, reused by Memory.alloc
+	std::vector<int> returns;	// return addresses; the frame in RAM keeps only their low bits
+	int16_t ram[32768];
+	int heapTop;
+	bool linked;
+	int function(std::string_view name);	// id of a named function, loaded or not
+	void link();	// binds calls to natives, fails on anything still missing
+	int16_t callNative(int id, int16_t* args, std::ostream& out, bool& halt);
+	int alloc(int n);
+	int staticAddress(std::string_view fileName, int index);
+public:
+	long long steps;	// instructions executed by the last run()
+	VMEmulator();
+	void load(const VMCode& code, std::string_view fileName);	// adds one class; statics are fileName.i. Load them all before run()
+	int16_t run(std::ostream& out, std::string_view entry = "", long long maxSteps = -1);	// Sys.init if loaded, else Main.main; Output goes to out; throws on runtime errors
+	int16_t peek(int address);
+};
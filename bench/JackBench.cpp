@@ -0,0 +1,179 @@
+#include "../JackCompiler.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/*
+*	Phase benchmark: times JackTokenizer, CompilationEngine and VMWriter separately over a corpus.
+*
+*	build:	g++ -std=c++17 -O2 -pthread -o JackBench JackBench.cpp ../JackCompiler.cpp ../VMCode.cpp ../JackStats.cpp ../JackAST.cpp ../CodeWriter.cpp
+*	usage:	JackBench [--stream] [--pool-strings] [--ast] [-O0] [-r runs] <file.jack | directory>...
+*
+*	Directories are searched recursively, so the nand2tetris projects/10 and projects/11
+*	folders can be passed as they are; JackGen makes a large synthetic corpus.
+*	Each phase runs over every file before the next one starts, so its peak RSS can be
+*	read on its own (Linux: VmHWM is reset through /proc/self/clear_refs). The best of
+*	the runs is reported. Output goes to a scratch folder, never next to the sources.
+*/
+
+struct JackBench {
+	typedef JackAnalyzer::JackTokenizer Tokenizer;
+	typedef JackAnalyzer::CompilationEngine<JackAnalyzer::VMOnly> Engine;
+
+	struct Phase {
+		const char* name;
+		double best = 1e30;	// seconds
+		long peakKB = -1;
+		long growthKB = -1;	// peak above the RSS the phase started with
+	};
+
+	vector<string> files;
+	filesystem::path scratch;
+	JackAnalyzer::Options opt;
+	long lines = 0, bytes = 0, tokens = 0;
+	Phase phases[3] = { { "JackTokenizer" }, { "CompilationEngine" }, { "VMWriter" } };
+
+	static long statusKB(const char* key) {	// a "Vm...:" line of /proc/self/status, -1 if unavailable
+		ifstream in("/proc/self/status");
+		string line;
+		size_t n = strlen(key);
+		while (getline(in, line)) {
+			if (line.compare(0, n, key) == 0)
+				return atol(line.c_str() + n);
+		}
+		return -1;
+	}
+
+	static void resetPeak() {
+		ofstream clear("/proc/self/clear_refs");
+		clear << "5";
+	}
+
+	void addPath(filesystem::path p) {
+		if (filesystem::is_directory(p)) {
+			for (const filesystem::directory_entry& e : filesystem::recursive_directory_iterator(p)) {
+				if (e.is_regular_file() && e.path().extension() == ".jack")
+					files.push_back(e.path().string());
+			}
+		}
+		else
+			files.push_back(p.string());
+	}
+
+	void measureCorpus() {
+		for (const string& f : files) {
+			ifstream in(f, ios::binary);
+			string text((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+			bytes += (long)text.size();
+			lines += (long)count(text.begin(), text.end(), '\n');
+			tokens += Tokenizer(f, opt.buffered).tokenCount();
+		}
+	}
+
+	template <class F>
+	void time(Phase& phase, F body) {
+		long start;
+		resetPeak();
+		start = statusKB("VmRSS:");
+		chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+		body();
+		chrono::duration<double> dt = chrono::steady_clock::now() - t0;
+		phase.best = min(phase.best, dt.count());
+		phase.peakKB = max(phase.peakKB, statusKB("VmHWM:"));
+		if (start >= 0)
+			phase.growthKB = max(phase.growthKB, phase.peakKB - start);
+	}
+
+	void run() {
+		vector<unique_ptr<Tokenizer>> T;
+		vector<unique_ptr<Engine>> C;
+
+		// each phase keeps its results alive for the next one, like a whole-program build
+		time(phases[0], [&] {
+			for (const string& f : files)
+				T.emplace_back(new Tokenizer(f, opt.buffered));
+		});
+		time(phases[1], [&] {
+			for (size_t i = 0; i < files.size(); i++) {
+				string out = (scratch / (to_string(i) + '_' + filesystem::path(files[i]).stem().string())).string();
+				C.emplace_back(new Engine(T[i].get(), out, opt));
+				C.back()->compile();
+			}
+		});
+		time(phases[2], [&] {
+			for (unique_ptr<Engine>& c : C)
+				c->close();
+		});
+	}
+
+	void report() {
+		double total = 0;
+		cout << "corpus: " << files.size() << " files, " << lines << " lines, " << tokens << " tokens, "
+			<< bytes / 1024 << " KB\n";
+		printf("%-18s %10s %12s %12s %12s %12s\n", "phase", "best ms", "Mtokens/s", "Klines/s", "peak RSS KB", "growth KB");
+		for (Phase& ph : phases) {
+			total += ph.best;
+			printf("%-18s %10.2f %12.2f %12.1f %12ld %12ld\n", ph.name, ph.best * 1e3,
+				tokens / ph.best / 1e6, lines / ph.best / 1e3, ph.peakKB, ph.growthKB);
+		}
+		printf("%-18s %10.2f %12.2f %12.1f\n", "total", total * 1e3, tokens / total / 1e6, lines / total / 1e3);
+	}
+
+	static int main(int argc, char* argv[]) {
+		JackBench B;
+		int runs = 5;
+
+		for (int i = 1; i < argc; i++) {
+			if (strcmp(argv[i], "--stream") == 0)
+				B.opt.buffered = false;
+			else if (strcmp(argv[i], "--pool-strings") == 0)
+				B.opt.pool = true;
+			else if (strcmp(argv[i], "--ast") == 0)
+				B.opt.ast = true;
+			else if (strcmp(argv[i], "-O0") == 0) {
+				B.opt.peephole = 0;
+				B.opt.fold = false;
+				B.opt.reduce = false;
+				B.opt.tailCalls = false;
+			}
+			else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+				runs = max(1, atoi(argv[++i]));
+			else
+				B.addPath(argv[i]);
+		}
+		if (B.files.empty()) {
+			cerr << "usage: JackBench [--stream] [--pool-strings] [--ast] [-O0] [-r runs] <file.jack | directory>...\n";
+			return 2;
+		}
+		sort(B.files.begin(), B.files.end());
+		B.scratch = filesystem::temp_directory_path() / "jackbench";
+		filesystem::create_directories(B.scratch);
+
+		try {
+			B.measureCorpus();
+			for (int r = 0; r < runs; r++)
+				B.run();
+		}
+		catch (const exception& e) {
+			cerr << e.what() << '\n';
+			return 1;
+		}
+		B.report();
+		filesystem::remove_all(B.scratch);
+		return 0;
+	}
+};
+
+int main(int argc, char* argv[]) {
+	return JackBench::main(argc, argv);
+}
@@ -0,0 +1,158 @@
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+/*
+*	Synthetic Jack corpus for JackBench. The same arguments always give the same files.
+*
+*	build:	g++ -std=c++17 -O2 -o JackGen JackGen.cpp
+*	usage:	JackGen <outdir> [classes = 50] [subroutines = 20] [depth = 4] [seed = 1]
+*
+*	Every class Gen<k> has statics, fields, a constructor, and methods/functions with
+*	many locals, deep parenthesized expressions, long string literals, arrays and calls into
+*	the other classes. The programs are valid Jack but are only meant to be compiled, not run.
+*/
+
+static uint64_t seed;
+static int classes, subroutines, depth;
+static bool inMethod;	// only methods may call m<i>() on this
+static const int LOCALS = 24;
+
+static unsigned rnd(unsigned n) {	// xorshift64*, so runs match across platforms
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return (unsigned)((seed * 2685821657736338717ull) >> 33) % n;
+}
+
+static string local() {
+	return "l" + to_string(rnd(LOCALS));
+}
+
+static string expression(int d);
+
+static string term(int d) {
+	static const char* consts[] = { "true", "false", "null" };
+	switch (d <= 0 ? rnd(3) : rnd(9)) {
+	case 0: return to_string(rnd(32768));
+	case 1: return local();
+	case 2: return d <= 0 ? consts[rnd(3)] : "a[" + local() + "]";
+	case 3: return "-" + term(d - 1);
+	case 4: return "~" + term(d - 1);
+	case 5: return "Gen" + to_string(rnd(classes)) + ".g" + to_string(rnd(subroutines)) + "(" + expression(d - 1) + ", " + local() + ")";
+	case 6:
+		if (inMethod)
+			return "m" + to_string(rnd(subroutines)) + "(" + expression(d - 1) + ", " + term(0) + ")";
+		// fall through
+	default: return "(" + expression(d - 1) + ")";
+	}
+}
+
+static string expression(int d) {
+	static const char ops[] = "+-*/&|<>=";
+	string e = term(d);
+	for (unsigned n = rnd(4); n > 0; n--) {
+		e += ' ';
+		e += ops[rnd(sizeof ops - 1)];
+		e += ' ';
+		e += term(d);
+	}
+	return e;
+}
+
+static string literal() {
+	static const char* words[] = { "score", "lives", "level", "press", "any", "key", "to", "start", "game", "over", "the", "quick", "brown", "fox" };
+	string s;
+	for (unsigned n = 4 + rnd(12); n > 0; n--) {
+		if (!s.empty())
+			s += ' ';
+		s += words[rnd(sizeof words / sizeof *words)];
+	}
+	return s;
+}
+
+static void statements(ofstream& out, string indent, int nest) {
+	for (unsigned n = 3 + rnd(6); n > 0; n--) {
+		switch (nest <= 0 ? rnd(4) : rnd(7)) {
+		case 0:
+		case 1:
+			out << indent << "let " << local() << " = " << expression(depth) << ";\n";
+			break;
+		case 2:
+			out << indent << "let a[" << local() << "] = " << expression(depth / 2) << ";\n";
+			break;
+		case 3:
+			out << indent << "do Output.printString(\"" << literal() << "\");\n";
+			break;
+		case 4:
+			out << indent << "if (" << expression(depth / 2) << ") {\n";
+			statements(out, indent + "    ", nest - 1);
+			out << indent << "} else {\n";
+			statements(out, indent + "    ", nest - 1);
+			out << indent << "}\n";
+			break;
+		case 5:
+			out << indent << "while (" << local() << " < " << rnd(100) << ") {\n";
+			statements(out, indent + "    ", nest - 1);
+			out << indent << "}\n";
+			break;
+		default:
+			out << indent << "do Gen" << rnd(classes) << ".g" << rnd(subroutines) << "(" << expression(depth / 2) << ", " << local() << ");\n";
+			break;
+		}
+	}
+}
+
+static void body(ofstream& out) {
+	out << "        var Array a;\n        var int l0";
+	for (int i = 1; i < LOCALS; i++)
+		out << ", l" << i;
+	out << ";\n        let a = Array.new(" << 1 + rnd(64) << ");\n";
+	statements(out, "        ", 2);
+	out << "        return " << expression(depth) << ";\n";
+}
+
+static void writeClass(filesystem::path dir, int k) {
+	string name = "Gen" + to_string(k);
+	ofstream out(dir / (name + ".jack"));
+
+	out << "/** generated by JackGen */\nclass " << name << " {\n";
+	out << "    static int s0, s1, s2;\n    field int f0, f1, f2, f3;\n\n";
+	out << "    constructor " << name << " new(int x) {\n        let f0 = x;\n        let f1 = x * 2;\n        return this;\n    }\n\n";
+	for (int i = 0; i < subroutines; i++) {
+		out << "    method int m" << i << "(int p, int q) {\n";
+		inMethod = true;
+		body(out);
+		inMethod = false;
+		out << "    }\n\n";
+		out << "    function int g" << i << "(int p, int q) {\n";
+		body(out);
+		out << "    }\n\n";
+	}
+	out << "}\n";
+}
+
+int main(int argc, char* argv[]) {
+	filesystem::path dir;
+	if (argc < 2) {
+		cerr << "usage: JackGen <outdir> [classes] [subroutines] [depth] [seed]\n";
+		return 2;
+	}
+	dir = argv[1];
+	classes = argc > 2 ? atoi(argv[2]) : 50;
+	subroutines = argc > 3 ? atoi(argv[3]) : 20;
+	depth = argc > 4 ? atoi(argv[4]) : 4;
+	seed = argc > 5 ? strtoull(argv[5], nullptr, 10) : 1;
+	if (seed == 0)
+		seed = 1;	// xorshift would stay at 0
+
+	filesystem::create_directories(dir);
+	for (int k = 0; k < classes; k++)
+		writeClass(dir, k);
+	return 0;
+}
@@ -1,16 +1,164 @@
 #include "JackCompiler.h"
+#include "VMEmulator.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
 
 using namespace std;
 
-int main() {
-	string filename;
+static void readVM(const filesystem::path& f, VMCode& code) {
+	// .vm text or a .vmb image, told apart by the magic rather than the extension
+	ifstream in(f, ios::binary);
+	if (!in)
+		throw runtime_error("cannot open " + f.string());
+	string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+	try {
+		if (VMCode::isBinary(data))
+			code.readBinary(data);
+		else
+			code.parse(data);
+	}
+	catch (const exception& e) {
+		throw runtime_error(f.string() + ": " + e.what());
+	}
+}
+
+static int convert(string input) {
+	// Xxx.vm -> Xxx.vmb and back
+	filesystem::path f(input);
+	VMCode code;
+	string out;
+	try {
+		readVM(f, code);
+		if (f.extension() == ".vmb") {
+			code.print(out);
+			f.replace_extension(".vm");
+		}
+		else {
+			code.writeBinary(out);
+			f.replace_extension(".vmb");
+		}
+		ofstream outFile(f, ios::binary);
+		if (!outFile.write(out.data(), out.size()))
+			throw runtime_error("cannot write " + f.string());
+	}
+	catch (const exception& e) {
+		cerr << "convert: " << e.what() << '\n';
+		return 1;
+	}
+	return 0;
+}
+
+static int runProgram(string input, bool binary) {
+	// loads the .vm/.vmb files the compiler just wrote (plus any others in the folder) and runs them
+	vector<filesystem::path> files;
+	VMEmulator E;
+	if (filesystem::is_directory(input)) {
+		for (const filesystem::directory_entry& e : filesystem::directory_iterator(input)) {
+			filesystem::path p = e.path();
+			if (!e.is_regular_file())
+				continue;
+			// one file per class: the .vmb where both are there
+			if (p.extension() == ".vmb" || (p.extension() == ".vm" && !filesystem::exists(filesystem::path(p).replace_extension(".vmb"))))
+				files.push_back(p);
+		}
+		sort(files.begin(), files.end());
+	}
+	else
+		files.push_back(filesystem::path(input).replace_extension(binary ? ".vmb" : ".vm"));
+	try {
+		for (const filesystem::path& f : files) {
+			VMCode code;
+			readVM(f, code);
+			E.load(code, f.stem().string());
+		}
+		chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+		E.run(cout);
+		chrono::duration<double> dt = chrono::steady_clock::now() - t0;
+		cout << flush;
+		cerr << E.steps << " VM instructions in " << dt.count() * 1e3 << " ms (" << E.steps / dt.count() / 1e6 << " M/s)\n";
+	}
+	catch (const exception& e) {
+		cerr << "run: " << e.what() << '\n';
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	string filename, statsFile, convertFile;
+	JackAnalyzer::Options opt;
+	bool run = false;
 	// seven test
 	// filename = "D:\\nand2tetris\\nand2tetris\\projects\\11\\Seven\\Main.jack";
 	
 	// ConvertToBin test
 	filename = "D:\\nand2tetris\\nand2tetris\\projects\\11\\ConvertToBin\\Main.jack";
 
-	JackAnalyzer J(filename, "out.xml");
+	// JackCompiler [--stream] [--no-cache] [--pool-strings] [--ast] [--inline N] [--prune] [--asm [--trampolines] [--keep-vm]] [--vmb] [--xml | --xml-only] [-O0] [-j N] [--stats report.json] [--run] <file.jack | directory>
+	// JackCompiler --convert <file.vm | file.vmb>
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--stream") == 0)
+			opt.buffered = false;
+		else if (strcmp(argv[i], "--no-cache") == 0)
+			opt.cache = false;
+		else if (strcmp(argv[i], "--pool-strings") == 0)
+			opt.pool = true;
+		else if (strcmp(argv[i], "--ast") == 0)
+			opt.ast = true;
+		else if (strcmp(argv[i], "--asm") == 0)
+			opt.hack = true;
+		else if (strcmp(argv[i], "--trampolines") == 0)
+			opt.trampolines = true;
+		else if (strcmp(argv[i], "--keep-vm") == 0)
+			opt.keepVM = true;
+		else if (strcmp(argv[i], "--inline") == 0 && i + 1 < argc)
+			opt.inlineSize = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--prune") == 0)
+			opt.prune = true;
+		else if (strcmp(argv[i], "--vmb") == 0)
+			opt.binary = true;
+		else if (strcmp(argv[i], "--convert") == 0 && i + 1 < argc)
+			convertFile = argv[++i];
+		else if (strcmp(argv[i], "--xml") == 0)
+			opt.output = JackAnalyzer::OUT_BOTH;
+		else if (strcmp(argv[i], "--xml-only") == 0)
+			opt.output = JackAnalyzer::OUT_XML;
+		else if (strcmp(argv[i], "-O0") == 0) {
+			opt.peephole = 0;
+			opt.fold = false;
+			opt.reduce = false;
+			opt.tailCalls = false;
+		}
+		else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+			opt.jobs = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc)
+			statsFile = argv[++i];
+		else if (strcmp(argv[i], "--run") == 0)
+			run = true;	// needs the .vm files: not with --xml-only, and --asm only with --keep-vm
+		else
+			filename = argv[i];
+	}
 
-	return 0;
+	if (!convertFile.empty())
+		return convert(convertFile);
+
+	JackAnalyzer J(filename, "out.xml", opt);
+	if (!statsFile.empty()) {
+#ifdef JACK_STATS
+		ofstream report(statsFile);
+		J.writeStats(report);
+#else
+		cerr << "--stats needs a build with -DJACK_STATS\n";
+#endif
+	}
+
+	if (J.failures())
+		return 1;
+	return run ? runProgram(filename, opt.binary) : 0;
 }
\ No newline at end of file